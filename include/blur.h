@@ -1,5 +1,7 @@
 #pragma once
 
+#include <vector>
+
 #include "grid.h"
 
 float gaus(
@@ -12,6 +14,38 @@ Grid<float> g_kernel(
 	float deviation
 );
 
+std::vector<float> g_kernel_1d(
+	size_t size, 
+	float deviation
+);
+
+// Integer gaussian whose weights add up to exactly 2^shift
+std::vector<int> g_kernel_fixed(
+	size_t size,
+	float deviation,
+	unsigned shift
+);
+
+// Gaussian blur of every channel in one pass, the mask is blended into the first `masked`
+// channels. Big radii are blurred on a coarse pyramid level and upsampled
+void blur_channels(
+	std::vector<Grid<int> *> const &channels,
+	size_t radius,
+	float sigma,
+	Grid<float> const * mask = nullptr,
+	size_t masked = 0
+);
+
+// Rows blur_channels reads above and below every row it blurs, and the multiple of rows bands
+// of an image have to start at to come out the same as blurring the whole image
+size_t blur_halo(
+	size_t radius
+);
+
+size_t blur_alignment(
+	size_t radius
+);
+
 Grid<int> convolve (
 	Grid<int> mat, 
 	Grid<float> const &kernel, 
@@ -23,8 +57,33 @@ Grid<int> dog(
 	float s_sigma
 );
 
+enum class EdgeMagnitude {
+	L2,
+	L1,
+	APPROXIMATE
+};
+
+// Pixels on the dark side of edges, where the difference of gaussians goes over threshold
+Grid<unsigned char> detect_outlines(
+	Grid<int> const &mat,
+	float sigma,
+	int threshold
+);
+
 Grid<float> detect_edges_sobel(
-	Grid<float> const &mat
+	Grid<float> const &mat,
+	EdgeMagnitude magnitude = EdgeMagnitude::L2
+);
+
+Grid<float> detect_edges_sobel(
+	Grid<int> const &mat,
+	EdgeMagnitude magnitude = EdgeMagnitude::L2
+);
+
+// Gradient magnitude before it is divided by its maximum, for images that are processed in bands
+Grid<float> sobel_magnitude(
+	Grid<int> const &mat,
+	EdgeMagnitude magnitude = EdgeMagnitude::L2
 );
 
 Grid<float> detect_edges_horizontal(
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+
+#include "grid.h"
+
+void bilateral_filter(
+	std::vector<Grid<int> *> const &channels,
+	Grid<int> const &guide,
+	float spatial_sigma,
+	float range_sigma
+);
+
+// Mean of the (2 * radius + 1)^2 window around every cell, clamped to the grid
+Grid<float> box_mean(
+	Grid<float> const &mat,
+	size_t radius
+);
+
+// Guided filter by He et al., every step is a box mean so its cost does not depend on the radius.
+// Epsilon is given for values between 0 and 1
+void guided_filter(
+	std::vector<Grid<int> *> const &channels,
+	Grid<int> const &guide,
+	size_t radius,
+	float epsilon
+);
+
+// Median of the (2 * radius + 1)^2 window around every pixel of 8 bit channels,
+// the borders are replicated and the cost does not depend on the radius
+void median_filter(
+	std::vector<Grid<int> *> const &channels,
+	size_t radius
+);
+
+// Edge directed antialiasing in the spirit of FXAA, steps is how far edges are followed
+void antialias(
+	Grid<int> * red,
+	Grid<int> * green,
+	Grid<int> * blue,
+	size_t steps
+);
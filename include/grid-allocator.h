@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+// Bytes of grid storage kept on the heap, allocations that would go past it are backed by
+// a memory mapped temporary file instead, so huge planes page to disk rather than failing.
+// 0 means there is no limit
+void set_grid_memory_limit(size_t bytes);
+
+void * grid_allocate(size_t bytes);
+void grid_deallocate(void * pointer, size_t bytes);
+
+template <typename T>
+struct GridAllocator {
+	using value_type = T;
+	using is_always_equal = std::true_type;
+
+	GridAllocator() = default;
+
+	template <typename U>
+	GridAllocator(GridAllocator<U> const &) {}
+
+	T * allocate(size_t const count) {
+		static_assert(alignof(T) <= alignof(std::max_align_t), "Grid storage is only aligned for fundamental types");
+		return static_cast<T *>(grid_allocate(count * sizeof(T)));
+	}
+
+	void deallocate(T * const pointer, size_t const count) {
+		grid_deallocate(pointer, count * sizeof(T));
+	}
+};
+
+template <typename T, typename U>
+bool operator== (GridAllocator<T> const &, GridAllocator<U> const &) { return true; }
+
+template <typename T, typename U>
+bool operator!= (GridAllocator<T> const &, GridAllocator<U> const &) { return false; }
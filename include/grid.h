@@ -5,12 +5,38 @@
 #include <algorithm>
 #include <functional>
 #include <limits>
+#include <utility>
+#include <type_traits>
+
+#include "parallel.h"
+#include "grid-allocator.h"
+
+template <typename T>
+class Grid;
+
+template <typename T, typename U>
+void convolve_channels_into(
+	std::vector<Grid<T> const *> const &in,
+	std::vector<Grid<T> *> const &out,
+	std::vector<U> const &kernel_v,
+	std::vector<U> const &kernel_h,
+	Grid<float> const *mask,
+	size_t const masked,
+	unsigned const shift
+);
 
 template <typename T>
 class Grid {
 
+public:
+
+// the storage can page to a temporary file once the memory limit is reached
+using Storage = std::vector<T, GridAllocator<T>>;
+
+private:
+
 size_t m_height, m_width;
-std::vector<T> m_data;
+Storage m_data;
 
 public:
 
@@ -46,8 +72,8 @@ inline bool	empty() const { return m_data.empty(); }
 inline size_t size() const { return m_data.size(); }
 inline size_t width() const { return m_width; }
 inline size_t height() const { return m_height; }
-inline std::vector<T>& data() { return m_data; }
-inline const std::vector<T>& data() const { return m_data; }
+inline Storage& data() { return m_data; }
+inline const Storage& data() const { return m_data; }
 inline T* raw() { return m_data.data(); }
 inline const T* raw() const { return m_data.data(); }
 
@@ -240,239 +266,39 @@ Grid<T> convolve_no_transpose(Grid<U> const &kernel, Grid<float> const &mask) co
 
 template <typename U>
 Grid<T> convolve(std::vector<U> const &kernel) const {
-	size_t const ks = kernel.size();
-	size_t const pad = ks / 2;
-
-	if (ks % 2 == 0) {
-		throw std::out_of_range("Vector to convolve must have odd size.");
-	}
-
-	using C = std::common_type_t<T, U>;
-
-	Grid<T> const padded = this->pad(pad);
-	Grid<C> temp(m_height + 2 * pad, m_width + 2 * pad, U{});
-	Grid<T> out(m_height, m_width, T{});
-
-	const U* __restrict kd = kernel.data();
-	const T* __restrict pd = padded.raw();
-	C* __restrict td = temp.raw();
-	T* __restrict od = out.raw();
-
-	size_t const pw = padded.width();
-	size_t const tw = temp.width();
-
-	//horizontal pass
-	for (size_t y = 0; y < m_height; y++) {
-		size_t const start_y = y + pad;
-
-		for (size_t x = 0; x < m_width; x++) {
-			size_t const start_x = x + pad;
-			C sum = 0;
-					
-			for (size_t i = 0; i < ks; i++) {
-				sum += pd[start_y * pw + x + i] * kd[i];
-			}
-
-			td[start_y * pw + start_x] = sum;
-		}	
-	}
-
-	//vertical pass
-	for (size_t y = 0; y < m_height; y++) {
-		for (size_t x = 0; x < m_width; x++) {
-			size_t const start_x = x + pad;
-			C sum = 0;
-
-			for (size_t i = 0; i < ks; i++) {
-				sum += td[(y + i) * tw + start_x] * kd[i];
-			}
-
-			od[y * m_width + x] = sum;
-		}
-	}
-
-	return out;
+	return this->convolve_separable(kernel, kernel);
 }
 
 template <typename U>
 Grid<T> convolve(std::vector<U> const &kernel, Grid<float> const &mask) const {
-	size_t const ks = kernel.size();
-	size_t const pad = ks / 2;
-
-	if (ks % 2 == 0) {
-		throw std::out_of_range("Vector to convolve must have odd size.");
-	} else if (m_height != mask.height() || m_width != mask.width()) {
-		throw std::out_of_range("Maks must be the same size as the grid to convolve.");
-	}
-
-	using C = std::common_type_t<T, U, float>;
-
-	Grid<T> const padded = this->pad(pad);
-	Grid<C> temp(m_height + 2 * pad, m_width + 2 * pad, U{});
-	Grid<T> out(m_height, m_width, T{});
-
-	const U* __restrict kd = kernel.data();
-	const T* __restrict pd = padded.raw();
-	const T* __restrict id = m_data.data();
-	const float* __restrict md = mask.raw();
-	C* __restrict td = temp.raw();
-	T* __restrict od = out.raw();
-
-	size_t const pw = padded.width();
-	size_t const tw = temp.width();
-
-	//horizontal pass
-	for (size_t y = 0; y < m_height; y++) {
-		size_t const start_y = y + pad;
-
-		for (size_t x = 0; x < m_width; x++) {
-			size_t const start_x = x + pad;
-			C sum = 0;
-					
-			for (size_t i = 0; i < ks; i++) {
-				sum += pd[start_y * pw + x + i] * kd[i];
-			}
-
-			td[start_y * pw + start_x] = sum;
-		}	
-	}
-
-	//vertical pass
-	for (size_t y = 0; y < m_height; y++) {
-		for (size_t x = 0; x < m_width; x++) {
-			size_t const start_x = x + pad;
-			C sum = 0;
-
-			for (size_t i = 0; i < ks; i++) {
-				sum += td[(y + i) * tw + start_x] * kd[i];
-			}
-
-			od[y * m_width + x] = sum * md[y * m_width + x] + id[y * m_width + x] * (1 - md[y * m_width + x]);
-		}
-	}
-
-	return out;
+	return this->convolve_separable(kernel, kernel, &mask);
 }
 
 template <typename U>
 Grid<T> convolve(std::vector<U> const &kernel_v, std::vector<U> const &kernel_h) const {
-	size_t const kvs = kernel_v.size();
-	size_t const pad_v = kvs / 2;
-	size_t const khs = kernel_h.size();
-	size_t const pad_h = khs / 2;
-
-	if (kvs % 2 == 0 || khs % 2 == 0) {
-		throw std::out_of_range("Vector to convolve must have odd size.");
-	}
-
-	using C = std::common_type_t<T, U>;
-
-	Grid<T> const padded = this->pad_vh(pad_v, pad_h);
-	Grid<C> temp(m_height + 2 * pad_v, m_width + 2 * pad_h, U{});
-	Grid<T> out(m_height, m_width, T{});
-
-	const U* __restrict kvd = kernel_v.data();
-	const U* __restrict khd = kernel_h.data();
-	const T* __restrict pd = padded.raw();
-	C* __restrict td = temp.raw();
-	T* __restrict od = out.raw();
-
-	size_t const pw = padded.width();
-	size_t const tw = temp.width();
-
-	//horizontal pass
-	for (size_t y = 0; y < m_height; y++) {
-		size_t const start_y = y + pad_v;
-
-		for (size_t x = 0; x < m_width; x++) {
-			size_t const start_x = x + pad_h;
-			C sum = 0;
-					
-			for (size_t i = 0; i < khs; i++) {
-				sum += pd[start_y * pw + x + i] * khd[i];
-			}
-
-			td[start_y * pw + start_x] = sum;
-		}	
-	}
-
-	//vertical pass
-	for (size_t y = 0; y < m_height; y++) {
-		for (size_t x = 0; x < m_width; x++) {
-			size_t const start_x = x + pad_h;
-			C sum = 0;
-
-			for (size_t i = 0; i < kvs; i++) {
-				sum += td[(y + i) * tw + start_x] * kvd[i];
-			}
-
-			od[y * m_width + x] = sum;
-		}
-	}
-
-	return out;
+	return this->convolve_separable(kernel_v, kernel_h);
 }
 
 template <typename U>
 Grid<T> convolve(std::vector<U> const &kernel_v, std::vector<U> const &kernel_h, Grid<float> const &mask) const {
-	size_t const kvs = kernel_v.size();
-	size_t const pad_v = kvs / 2;
-	size_t const khs = kernel_h.size();
-	size_t const pad_h = khs / 2;
-
-	if (kvs % 2 == 0 || khs % 2 == 0) {
-		throw std::out_of_range("Vector to convolve must have odd size.");
-	} else if (m_height != mask.height() || m_width != mask.width()) {
-		throw std::out_of_range("Maks must be the same size as the grid to convolve.");
-	}
-
-	using C = std::common_type_t<T, U>;
-
-	Grid<T> const padded = this->pad_vh(pad_v, pad_h);
-	Grid<C> temp(m_height + 2 * pad_v, m_width + 2 * pad_h, U{});
-	Grid<T> out(m_height, m_width, T{});
-
-	const U* __restrict kvd = kernel_v.data();
-	const U* __restrict khd = kernel_h.data();
-	const T* __restrict pd = padded.raw();
-	const T* __restrict id = m_data.data();
-	const float* __restrict md = mask.raw();
-	C* __restrict td = temp.raw();
-	T* __restrict od = out.raw();
-
-	size_t const pw = padded.width();
-	size_t const tw = temp.width();
-
-	//horizontal pass
-	for (size_t y = 0; y < m_height; y++) {
-		size_t const start_y = y + pad_v;
-
-		for (size_t x = 0; x < m_width; x++) {
-			size_t const start_x = x + pad_h;
-			C sum = 0;
-					
-			for (size_t i = 0; i < khs; i++) {
-				sum += pd[start_y * pw + x + i] * khd[i];
-			}
-
-			td[start_y * pw + start_x] = sum;
-		}	
-	}
-
-	//vertical pass
-	for (size_t y = 0; y < m_height; y++) {
-		for (size_t x = 0; x < m_width; x++) {
-			size_t const start_x = x + pad_h;
-			C sum = 0;
-
-			for (size_t i = 0; i < kvs; i++) {
-				sum += td[(y + i) * tw + start_x] * kvd[i];
-			}
+	return this->convolve_separable(kernel_v, kernel_h, &mask);
+}
 
-			od[y * m_width + x] = sum * md[y * m_width + x] + id[y * m_width + x] * (1 - md[y * m_width + x]);
-		}
-	}
+// Rows per band for the separable convolutions, the intermediate rows of a band
+// plus its halo are kept under half of L2 so the vertical pass reads them from cache
+static size_t band_height(size_t const width, size_t const halo, size_t const item_size) {
+	size_t const rows = l2_cache_size() / 2 / std::max<size_t>(width * item_size, 1);
+	return std::max(rows, halo + 1) - halo;
+}
 
+template <typename U>
+Grid<T> convolve_separable(
+	std::vector<U> const &kernel_v,
+	std::vector<U> const &kernel_h,
+	Grid<float> const *mask = nullptr
+) const {
+	Grid<T> out;
+	convolve_channels_into<T, U>({this}, {&out}, kernel_v, kernel_h, mask, 1, 0);
 	return out;
 }
 
@@ -613,7 +439,7 @@ Grid<T> convolve_vertical(std::vector<U> const &kernel, Grid<float> const &mask)
 
 // SHAPING
 Grid<T>& resize (size_t const height, size_t const width, T const &value = T{}) {
-	std::vector<T> new_data(height * width, value);
+	Storage new_data(height * width, value);
 	// invariants
 	size_t const min_height = std::min(height, m_height);
 	size_t const min_width = std::min(width, m_width);
@@ -636,7 +462,7 @@ Grid<T>& resize (size_t const height, size_t const width, T const &value = T{})
 }
 
 Grid<T>& transpose() {
-	std::vector<T> new_data(m_height * m_width);
+	Storage new_data(m_height * m_width);
 
 	T* __restrict raw = m_data.data();
 	T* __restrict new_raw = new_data.data();
@@ -679,7 +505,7 @@ Grid<T>& insert_columns (size_t position, size_t amount, T const &value = T{}) {
 	position = std::min(position, m_width);
 	size_t const new_width = m_width + amount;
 
-	std::vector<T> new_data(m_height * new_width);
+	Storage new_data(m_height * new_width);
 
 	for (size_t i = 0; i < m_height; i++){
 		T* old_row = m_data.data() + i * m_width;
@@ -886,7 +712,7 @@ Grid<T>& operator+= (Grid<U> const &input) {
 	
 	size_t const size = this->size();
 	T* __restrict data = this->raw();
-	U* __restrict input_data = input.raw();
+	const U* __restrict input_data = input.raw();
 	
 	for (size_t i = 0; i < size; i++){
 		data[i] += input_data[i];
@@ -922,7 +748,7 @@ Grid<T>& operator-= (Grid<U> const &input) {
 	
 	size_t const size = this->size();
 	T* __restrict data = this->raw();
-	U* __restrict input_data = input.raw();
+	const U* __restrict input_data = input.raw();
 	
 	for (size_t i = 0; i < size; i++){
 		data[i] -= input_data[i];
@@ -958,7 +784,7 @@ Grid<T>& operator*= (Grid<U> const &input) {
 	
 	size_t const size = this->size();
 	T* __restrict data = this->raw();
-	U* __restrict input_data = input.raw();
+	const U* __restrict input_data = input.raw();
 	
 	for (size_t i = 0; i < size; i++){
 		data[i] *= input_data[i];
@@ -994,7 +820,7 @@ Grid<T>& operator/= (Grid<U> const &input) {
 	
 	size_t const size = this->size();
 	T* __restrict data = this->raw();
-	U* __restrict input_data = input.raw();
+	const U* __restrict input_data = input.raw();
 	
 	for (size_t i = 0; i < size; i++){
 		data[i] /= input_data[i];
@@ -1019,3 +845,190 @@ Grid<T> operator/ (U const &scalar, Grid<T> const &mat) {
 		return static_cast<T>(s / x);
 	}, scalar);
 }
+
+
+// MULTI-CHANNEL CONVOLUTION
+
+constexpr unsigned MASK_SHIFT = 8;
+
+// Convolves every grid in `in` into the matching grid in `out` in lockstep, walking
+// the image once in row bands. The mask is read once per pixel and blended into the
+// first `masked` channels, the rest are convolved without it.
+// With integer grids and kernels everything stays in integers: the sums are rounded
+// and shifted right by `shift` (the fixed point bits of both kernels together) and
+// the mask is blended with MASK_SHIFT bits of precision, so results are bit exact.
+template <typename T, typename U>
+void convolve_channels_into(
+	std::vector<Grid<T> const *> const &in,
+	std::vector<Grid<T> *> const &out,
+	std::vector<U> const &kernel_v,
+	std::vector<U> const &kernel_h,
+	Grid<float> const *mask,
+	size_t const masked,
+	unsigned const shift
+) {
+	size_t const channels = in.size();
+	size_t const kvs = kernel_v.size();
+	size_t const pad_v = kvs / 2;
+	size_t const khs = kernel_h.size();
+	size_t const pad_h = khs / 2;
+
+	if (channels == 0 || channels != out.size()) {
+		throw std::out_of_range("Every channel to convolve needs an output grid.");
+	} else if (kvs % 2 == 0 || khs % 2 == 0) {
+		throw std::out_of_range("Vector to convolve must have odd size.");
+	}
+
+	size_t const height = in[0]->height();
+	size_t const width = in[0]->width();
+
+	for (size_t c = 0; c < channels; c++) {
+		if (in[c]->height() != height || in[c]->width() != width) {
+			throw std::out_of_range("Grids to convolve have different dimensions.");
+		} else if (out[c] == in[c]) {
+			throw std::out_of_range("Grids can not be convolved into themselves.");
+		}
+		out[c]->reshape_raw(height, width);
+	}
+
+	if (mask && (height != mask->height() || width != mask->width())) {
+		throw std::out_of_range("Maks must be the same size as the grid to convolve.");
+	}
+
+	using C = std::common_type_t<T, U>;
+	using W = std::conditional_t<std::is_integral_v<C>, C, float>;
+
+	W constexpr MASK_ONE = std::is_integral_v<C> ? static_cast<W>(1u << MASK_SHIFT) : W(1);
+	C const half = (std::is_integral_v<C> && shift > 0) ? static_cast<C>(1u << (shift - 1)) : C{};
+
+	// every band filters its kvs - 1 halo rows again, with several wide channels the cache sized
+	// band would be a few rows, so it is kept at a multiple of the halo to bound that work
+	size_t constexpr MIN_HALO_MULTIPLE = 4;
+	size_t const threads = thread_count();
+	size_t const band = std::max(
+		std::min(
+			Grid<T>::band_height(width, kvs - 1, sizeof(C) * channels),
+			(height + threads - 1) / threads
+		),
+		MIN_HALO_MULTIPLE * (kvs - 1)
+	);
+
+	parallel_bands(height, band, [&](size_t const start, size_t const end) {
+		size_t const rows = end - start + kvs - 1;
+
+		std::vector<T> line(width + 2 * pad_h, T{});
+		std::vector<C> sum(width);
+		std::vector<W> inverse(mask ? width : 0);
+		std::vector<Grid<C>> temp(channels, Grid<C>(rows, width));
+
+		const U* __restrict kvd = kernel_v.data();
+		const U* __restrict khd = kernel_h.data();
+		T* __restrict ld = line.data();
+		C* __restrict sd = sum.data();
+		W* __restrict vd = inverse.data();
+
+		//horizontal pass over the band and its halo rows
+		for (size_t c = 0; c < channels; c++) {
+			for (size_t r = 0; r < rows; r++) {
+				C* __restrict td = temp[c][r];
+				std::fill_n(td, width, C{});
+
+				size_t const y = start + r;
+				if (y < pad_v || y - pad_v >= height) continue;
+
+				std::copy_n((*in[c])[y - pad_v], width, ld + pad_h);
+
+				for (size_t i = 0; i < khs; i++) {
+					for (size_t x = 0; x < width; x++) {
+						td[x] += ld[x + i] * khd[i];
+					}
+				}
+			}
+		}
+
+		//vertical pass
+		for (size_t y = start; y < end; y++) {
+			const float* __restrict md = mask ? (*mask)[y] : nullptr;
+
+			if (mask) {
+				for (size_t x = 0; x < width; x++) {
+					if constexpr (std::is_integral_v<C>) {
+						vd[x] = MASK_ONE - static_cast<W>(md[x] * MASK_ONE + 0.5f);
+					} else {
+						vd[x] = 1 - md[x];
+					}
+				}
+			}
+
+			for (size_t c = 0; c < channels; c++) {
+				std::fill_n(sd, width, C{});
+
+				for (size_t i = 0; i < kvs; i++) {
+					const C* __restrict td = temp[c][y - start + i];
+					for (size_t x = 0; x < width; x++) {
+						sd[x] += td[x] * kvd[i];
+					}
+				}
+
+				if constexpr (std::is_integral_v<C>) {
+					for (size_t x = 0; x < width; x++) {
+						sd[x] = (sd[x] + half) >> shift;
+					}
+				}
+
+				const T* __restrict id = (*in[c])[y];
+				T* __restrict od = (*out[c])[y];
+
+				if (mask && c < masked) {
+					for (size_t x = 0; x < width; x++) {
+						if constexpr (std::is_integral_v<C>) {
+							od[x] = (sd[x] * (MASK_ONE - vd[x]) + id[x] * vd[x] + MASK_ONE / 2) >> MASK_SHIFT;
+						} else {
+							od[x] = sd[x] * md[x] + id[x] * vd[x];
+						}
+					}
+				} else {
+					for (size_t x = 0; x < width; x++) {
+						od[x] = sd[x];
+					}
+				}
+			}
+		}
+	});
+}
+
+// Convolves the grids in place, see convolve_channels_into
+template <typename T, typename U>
+void convolve_channels(
+	std::vector<Grid<T> *> const &grids,
+	std::vector<U> const &kernel_v,
+	std::vector<U> const &kernel_h,
+	Grid<float> const *mask = nullptr,
+	size_t const masked = std::numeric_limits<size_t>::max(),
+	unsigned const shift = 0
+) {
+	std::vector<Grid<T>> results(grids.size());
+	std::vector<Grid<T> const *> in(grids.begin(), grids.end());
+	std::vector<Grid<T> *> out;
+
+	for (auto &result : results) {
+		out.push_back(&result);
+	}
+
+	convolve_channels_into(in, out, kernel_v, kernel_h, mask, masked, shift);
+
+	for (size_t c = 0; c < grids.size(); c++) {
+		*grids[c] = std::move(results[c]);
+	}
+}
+
+template <typename T, typename U>
+void convolve_channels(
+	std::vector<Grid<T> *> const &grids,
+	std::vector<U> const &kernel,
+	Grid<float> const *mask = nullptr,
+	size_t const masked = std::numeric_limits<size_t>::max(),
+	unsigned const shift = 0
+) {
+	convolve_channels(grids, kernel, kernel, mask, masked, shift);
+}
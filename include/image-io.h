@@ -0,0 +1,13 @@
+#pragma once
+
+#include <filesystem>
+
+// Decodes an image through a read only mapping of the file, which is dropped as soon as the
+// pixels are out. Falls back to stbi_load when the file cannot be mapped.
+// The pixels are released with stbi_image_free
+unsigned char * load_image(
+	std::filesystem::path const &path,
+	int * width,
+	int * height,
+	int * channels
+);
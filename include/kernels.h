@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <type_traits>
+
+#include "parallel.h"
+
+// Runs a per pixel kernel over interleaved 8 bit pixels, the rows are split between the cores.
+// kernel(in, out) reads the RGB bytes of one pixel and writes the RGB bytes of the result,
+// the alpha byte of RGBA images is copied as it is. Input and output can be the same buffer
+// as long as the kernel reads its pixel before writing it.
+// The output is either bytes or floats between 0 and 1, which go through one row of bytes first
+template <typename K, typename O>
+void apply_pixel_kernel(
+	unsigned char const * input,
+	O * output,
+	size_t const height,
+	size_t const width,
+	size_t const channels,
+	K const &kernel
+){
+	static_assert(std::is_same_v<O, unsigned char> || std::is_floating_point_v<O>, "Output must be bytes or floats");
+
+	size_t constexpr BAND_ROWS = 16;
+	size_t const stride = width * channels;
+
+	parallel_bands(height, BAND_ROWS, [&](size_t const start, size_t const end) {
+		std::vector<unsigned char> row(std::is_same_v<O, unsigned char> ? 0 : stride);
+
+		for (size_t i = start; i < end; i++) {
+			unsigned char const * in = input + i * stride;
+			unsigned char * out;
+
+			if constexpr (std::is_same_v<O, unsigned char>) {
+				out = output + i * stride;
+			} else {
+				out = row.data();
+			}
+
+			if (channels == 4) {
+				for (size_t j = 0; j < stride; j += 4) {
+					kernel(in + j, out + j);
+					out[j + 3] = in[j + 3];
+				}
+			} else {
+				for (size_t j = 0; j < stride; j += channels) {
+					kernel(in + j, out + j);
+				}
+			}
+
+			if constexpr (std::is_floating_point_v<O>) {
+				O * __restrict target = output + i * stride;
+				for (size_t j = 0; j < stride; j++) {
+					target[j] = static_cast<O>(out[j]) / 255;
+				}
+			}
+		}
+	});
+}
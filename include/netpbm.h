@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdio>
+#include <filesystem>
+
+#include "row-reader.h"
+
+bool is_netpbm(
+	std::filesystem::path const &path
+);
+
+// Reads the header of a binary PPM (P6) or PAM (P7) file with 8 bit samples, PAM files can be RGB or RGB_ALPHA.
+// The file is left at the first sample
+bool read_netpbm_header(
+	FILE * file,
+	RowLayout &layout
+);
+
+// Writes PAM when the path ends in .pam and PPM when it ends in .ppm, PPM only holds RGB
+class NetpbmWriter {
+
+FILE * m_file = nullptr;
+size_t m_width = 0;
+size_t m_channels = 0;
+
+public:
+
+NetpbmWriter() = default;
+NetpbmWriter(NetpbmWriter const &) = delete;
+NetpbmWriter& operator= (NetpbmWriter const &) = delete;
+~NetpbmWriter();
+
+bool open(std::filesystem::path const &path, size_t height, size_t width, size_t channels);
+
+bool write_rows(unsigned char const * in, size_t rows);
+
+// Flushes the file, the writer can not be used afterward
+bool close();
+
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <unistd.h>
+
+// Cores the calling thread may spread work over, 0 means all of them. Batches that process
+// several images at once give each one a single core
+inline thread_local size_t thread_budget = 0;
+
+inline size_t thread_count() {
+	if (thread_budget > 0) return thread_budget;
+
+	size_t const count = std::thread::hardware_concurrency();
+	return count == 0 ? 1 : count;
+}
+
+inline size_t l2_cache_size() {
+	long const size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	return size > 0 ? static_cast<size_t>(size) : 256 * 1024;
+}
+
+// Splits [0, rows) into bands of band_rows rows and calls func(start, end) for each one,
+// the bands are handed out to the available cores as they finish the previous one
+template <typename F>
+void parallel_bands(size_t const rows, size_t const band_rows, F&& func) {
+	if (rows == 0) return;
+
+	size_t const band = std::max<size_t>(band_rows, 1);
+	size_t const band_count = (rows + band - 1) / band;
+	size_t const workers = std::min(thread_count(), band_count);
+	std::atomic<size_t> next(0);
+
+	auto worker = [&]() {
+		for (size_t b = next++; b < band_count; b = next++) {
+			func(b * band, std::min(rows, (b + 1) * band));
+		}
+	};
+
+	if (workers <= 1) {
+		worker();
+		return;
+	}
+
+	std::vector<std::thread> pool;
+	pool.reserve(workers - 1);
+
+	// the cores are all taken already, so anything parallel inside a band runs on its own thread
+	for (size_t i = 0; i < workers - 1; i++) {
+		pool.emplace_back([&]() {
+			thread_budget = 1;
+			worker();
+		});
+	}
+
+	worker();
+
+	for (auto &floaty : pool) {
+		floaty.join();
+	}
+}
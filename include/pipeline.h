@@ -0,0 +1,117 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <condition_variable>
+
+#include "parallel.h"
+
+// Queue between two pipeline stages. Push waits while it is full, so a fast stage cannot run ahead
+// and fill the memory with items the next one has no time for, pop waits while it is empty
+template <typename T>
+class BoundedQueue {
+
+std::deque<T> m_items;
+size_t m_capacity;
+bool m_closed = false;
+std::mutex m_mutex;
+std::condition_variable m_not_empty, m_not_full;
+
+public:
+
+BoundedQueue (size_t const capacity) : m_capacity(std::max<size_t>(capacity, 1)) {}
+
+void push(T item) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_not_full.wait(lock, [&]() { return m_items.size() < m_capacity; });
+	m_items.push_back(std::move(item));
+	lock.unlock();
+	m_not_empty.notify_one();
+}
+
+// False once the queue is closed and every item was taken
+bool pop(T &item) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_not_empty.wait(lock, [&]() { return !m_items.empty() || m_closed; });
+	if (m_items.empty()) return false;
+
+	item = std::move(m_items.front());
+	m_items.pop_front();
+	lock.unlock();
+	m_not_full.notify_one();
+	return true;
+}
+
+void close() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = true;
+	}
+	m_not_empty.notify_all();
+}
+
+};
+
+// Nanoseconds the threads of a stage spent working, waiting for items and waiting for space after it.
+// Available is the thread time the stage had, its threads times how long it ran, summed over runs
+struct StageTimes {
+	std::atomic<int64_t> busy{0};
+	std::atomic<int64_t> starved{0};
+	std::atomic<int64_t> blocked{0};
+	int64_t available = 0;
+};
+
+// Starts `threads` workers that take items from input and pass them to func(item), the ones it
+// returns true for go on to output. Output is closed when the last worker ends, so the next stage
+// stops once it is empty. Budget is the thread_budget of every worker, 0 for all the cores
+template <typename T, typename F>
+void start_stage(
+	std::vector<std::thread> &pool,
+	BoundedQueue<T> &input,
+	BoundedQueue<T> * output,
+	size_t const threads,
+	size_t const budget,
+	StageTimes &times,
+	F func
+){
+	using clock = std::chrono::steady_clock;
+	auto elapsed = [](clock::time_point const since) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - since).count();
+	};
+
+	auto running = std::make_shared<std::atomic<size_t>>(threads);
+
+	for (size_t i = 0; i < threads; i++) {
+		pool.emplace_back([&input, output, budget, &times, func, running, elapsed]() {
+			thread_budget = budget;
+			T item;
+
+			for (;;) {
+				clock::time_point start = clock::now();
+				bool const got = input.pop(item);
+				times.starved += elapsed(start);
+				if (!got) break;
+
+				start = clock::now();
+				bool const passed = func(item);
+				times.busy += elapsed(start);
+
+				if (passed && output) {
+					start = clock::now();
+					output->push(std::move(item));
+					times.blocked += elapsed(start);
+				}
+			}
+
+			if (--*running == 0 && output) output->close();
+		});
+	}
+}
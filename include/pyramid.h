@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include "grid.h"
+#include "parallel.h"
+
+// Gaussian pyramid, every level halves the one below it after a [1 4 6 4 1] / 16 blur.
+// Operations with big radii can run on a coarse level at a quarter of the work per level
+template <typename T>
+class Pyramid {
+
+std::vector<Grid<T>> m_levels;
+
+public:
+
+Pyramid (Grid<T> base, size_t const levels) {
+	m_levels.reserve(levels + 1);
+	m_levels.push_back(std::move(base));
+
+	for (size_t i = 0; i < levels && m_levels.back().height() > 1 && m_levels.back().width() > 1; i++) {
+		m_levels.push_back(reduce(m_levels.back()));
+	}
+}
+
+inline size_t levels() const { return m_levels.size() - 1; }
+inline Grid<T> const& operator[] (size_t const level) const { return m_levels[level]; }
+inline Grid<T> const& top() const { return m_levels.back(); }
+
+// Deepest level at which `radius` still spans at least `min_radius` cells
+static size_t level_for(float radius, float const min_radius) {
+	size_t level = 0;
+	while (radius / 2 >= min_radius) {
+		radius /= 2;
+		level++;
+	}
+	return level;
+}
+
+static Grid<T> reduce(Grid<T> const &mat) {
+	using C = std::conditional_t<std::is_integral_v<T>, long, T>;
+	int constexpr WEIGHTS[5] = { 1, 4, 6, 4, 1 };
+
+	size_t const height = mat.height();
+	size_t const width = mat.width();
+	size_t const new_height = (height + 1) / 2;
+	size_t const new_width = (width + 1) / 2;
+
+	Grid<T> out(new_height, new_width);
+	if (out.empty()) return out;
+
+	auto clamp = [](long const i, size_t const size) {
+		return static_cast<size_t>(std::clamp<long>(i, 0, static_cast<long>(size) - 1));
+	};
+
+	parallel_bands(new_height, 64, [&](size_t const start, size_t const end) {
+		std::vector<C> column(width);
+		C* __restrict cd = column.data();
+
+		for (size_t i = start; i < end; i++) {
+			//vertical taps around row 2i
+			std::fill_n(cd, width, C{});
+			for (long t = 0; t < 5; t++) {
+				const T* __restrict src = mat[clamp(2 * static_cast<long>(i) + t - 2, height)];
+				for (size_t x = 0; x < width; x++) {
+					cd[x] += src[x] * WEIGHTS[t];
+				}
+			}
+
+			//horizontal taps around column 2j
+			T* __restrict od = out[i];
+			for (size_t j = 0; j < new_width; j++) {
+				C sum = 0;
+				for (long t = 0; t < 5; t++) {
+					sum += cd[clamp(2 * static_cast<long>(j) + t - 2, width)] * WEIGHTS[t];
+				}
+
+				if constexpr (std::is_integral_v<T>) {
+					od[j] = (sum + 128) >> 8;
+				} else {
+					od[j] = sum / 256;
+				}
+			}
+		}
+	});
+
+	return out;
+}
+
+// Size of a level over the size it is expanded to. When the size reduces to the level it is exactly
+// a power of two, otherwise odd sizes would shift the expanded image by up to half a cell of the level
+static float ratio(size_t const level_size, size_t const size) {
+	size_t reduced = size;
+	float scale = 1;
+
+	while (reduced > level_size) {
+		reduced = (reduced + 1) / 2;
+		scale /= 2;
+	}
+
+	return reduced == level_size ? scale : static_cast<float>(level_size) / size;
+}
+
+// Bilinear upsampling of a level to any size, usually the size of the base
+static Grid<T> expand(Grid<T> const &mat, size_t const height, size_t const width) {
+	Grid<T> out(height, width);
+	if (out.empty() || mat.empty()) return out;
+
+	float const v_scale = ratio(mat.height(), height);
+	float const h_scale = ratio(mat.width(), width);
+
+	auto source = [](size_t const i, float const scale, size_t const size, size_t &index, float &weight) {
+		float const position = std::clamp((i + 0.5f) * scale - 0.5f, 0.0f, static_cast<float>(size - 1));
+		index = std::min(static_cast<size_t>(position), size > 1 ? size - 2 : 0);
+		weight = size > 1 ? position - index : 0.0f;
+	};
+
+	std::vector<size_t> column_index(width);
+	std::vector<float> column_weight(width);
+	for (size_t x = 0; x < width; x++) {
+		source(x, h_scale, mat.width(), column_index[x], column_weight[x]);
+	}
+
+	size_t const last = mat.width() > 1 ? 1 : 0;
+
+	parallel_bands(height, 64, [&](size_t const start, size_t const end) {
+		for (size_t y = start; y < end; y++) {
+			size_t iy;
+			float wy;
+			source(y, v_scale, mat.height(), iy, wy);
+
+			const T* __restrict top = mat[iy];
+			const T* __restrict bottom = mat[mat.height() > 1 ? iy + 1 : iy];
+			T* __restrict od = out[y];
+
+			for (size_t x = 0; x < width; x++) {
+				size_t const ix = column_index[x];
+				float const wx = column_weight[x];
+				float const upper = top[ix] * (1 - wx) + top[ix + last] * wx;
+				float const lower = bottom[ix] * (1 - wx) + bottom[ix + last] * wx;
+				float const value = upper * (1 - wy) + lower * wy;
+
+				if constexpr (std::is_integral_v<T>) {
+					od[x] = static_cast<T>(std::lround(value));
+				} else {
+					od[x] = value;
+				}
+			}
+		}
+	});
+
+	return out;
+}
+
+};
@@ -32,3 +32,21 @@ std::vector<unsigned char> flatten(
 	Grid<int> const * blue = nullptr,
 	Grid<int> const * alpha = nullptr
 );
+
+// Interleaves the planes into a buffer of height * width * channels values that the caller owns,
+// bytes saturate to 0 - 255 and floats are scaled to 0 - 1
+bool flatten_into(
+	unsigned char * out,
+	Grid<int> const * red,
+	Grid<int> const * green = nullptr,
+	Grid<int> const * blue = nullptr,
+	Grid<int> const * alpha = nullptr
+);
+
+bool flatten_into(
+	float * out,
+	Grid<int> const * red,
+	Grid<int> const * green = nullptr,
+	Grid<int> const * blue = nullptr,
+	Grid<int> const * alpha = nullptr
+);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <vector>
+
+// Resizes interleaved 8 bit pixels, every axis that shrinks averages the area each
+// output pixel covers and every axis that grows is interpolated bilinearly
+std::vector<unsigned char> resize_image(
+	unsigned char const * data,
+	size_t old_height,
+	size_t old_width,
+	size_t new_height,
+	size_t new_width,
+	size_t channels
+);
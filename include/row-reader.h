@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdio>
+#include <vector>
+#include <filesystem>
+
+// Where the samples of an uncompressed image lie in its file. Rows of width pixels of pixel_bytes
+// each start every stride bytes from data_start, from the bottom row up when bottom_up is set
+struct RowLayout {
+	off_t data_start = 0;
+	size_t height = 0;
+	size_t width = 0;
+	size_t channels = 0;
+	size_t pixel_bytes = 0;
+	size_t stride = 0;
+	bool bottom_up = false;
+	// samples are stored blue, green, red
+	bool bgr = false;
+	// the alpha of every pixel is 0 and is read as 255, the way stb_image reads such BMP files
+	bool opaque = false;
+};
+
+// The extensions of the images RowReader can read
+bool is_streamable(
+	std::filesystem::path const &path
+);
+
+// Reads binary PPM and PAM, uncompressed 24 and 32 bit BMP and uncompressed 24 and 32 bit TGA files
+// with 8 bit samples a band of rows at a time, from the top row down. Rows come out RGB or RGBA
+class RowReader {
+
+FILE * m_file = nullptr;
+RowLayout m_layout;
+size_t m_row = 0;
+std::vector<unsigned char> m_buffer;
+
+void convert_rows(unsigned char * out, size_t rows);
+
+public:
+
+RowReader() = default;
+RowReader(RowReader const &) = delete;
+RowReader& operator= (RowReader const &) = delete;
+~RowReader();
+
+bool open(std::filesystem::path const &path);
+
+// Goes back to the first row
+bool rewind();
+
+bool read_rows(unsigned char * out, size_t rows);
+
+inline size_t height() const { return m_layout.height; }
+inline size_t width() const { return m_layout.width; }
+inline size_t channels() const { return m_layout.channels; }
+
+};
@@ -4,15 +4,23 @@
 #define OPTIONAL_ARGS \
     OPTIONAL_STRING_ARG(palette, "nord", "-p", "palette", "Palette used for search and equidistant modes") \
     OPTIONAL_UINT_ARG(resolution, 8, "-r", "resolution", "Amount of colors for self and self-sort modes") \
+    OPTIONAL_UINT_ARG(median, 0, "-m", "median", "Radius of the median filter used to remove noise before quantization") \
     OPTIONAL_UINT_ARG(blur, 0, "-b", "blur", "Blur radius for edge detection based blur before quantization") \
-    OPTIONAL_UINT_ARG(antialiasing, 0, "-a", "antialiasing", "Smooth edges after processing") \
+    OPTIONAL_STRING_ARG(filter, "edges", "-f", "filter", "Smoothing used by '-b', options are: edges, bilateral, guided") \
+    OPTIONAL_UINT_ARG(cartoon, 0, "-c", "cartoon", "Sigma of the difference of gaussians used to draw dark outlines over the output") \
+    OPTIONAL_UINT_ARG(antialiasing, 0, "-a", "antialiasing", "Smooth edges after processing, pass how many pixels each edge is followed") \
     OPTIONAL_UINT_ARG(quality, 80, "-q", "quality", "Number between 1 and 100 for quality to export .jpg images") \
     OPTIONAL_STRING_ARG(output_file, "", "-o", "output", "Output file path") \
+    OPTIONAL_FLOAT_ARG(scale, 1.0f, "-s", "scale", "Scale the image by this factor before processing, the output keeps the new size", 2) \
+    OPTIONAL_UINT_ARG(max_memory, 0, "--max-memory", "megabytes", "Megabytes of image planes kept in memory, bigger ones go to a temporary file. 0 means no limit") \
 
 #define BOOLEAN_ARGS \
     BOOLEAN_ARG(help, "-h", "Show help") \
     BOOLEAN_ARG(print, "--print", "Print processed image to the console without saving it unless '-o' is also passed") \
     BOOLEAN_ARG(dry, "--dry", "Run the program without saving the processed image") \
+    BOOLEAN_ARG(sample, "--sample", "Take the statistics of self-sort from a quarter size copy of the image") \
+    BOOLEAN_ARG(stream, "--stream", "Process PPM, PAM and uncompressed BMP and TGA images a band of rows at a time, for images that do not fit in memory") \
+    BOOLEAN_ARG(fast_edges, "--fast-edges", "Approximate the edge magnitude for '-b' instead of computing square roots") \
 
 
 #ifdef __cplusplus
@@ -38,13 +46,27 @@ extern "C" {
 #include <filesystem>
 #include <sys/ioctl.h>
 #include <array>
+#include <cstdint>
+#include <memory>
+#include <cstring>
 #include <thread>
+#include <atomic>
+#include <fstream>
+#include <optional>
+#include <chrono>
 
 #include "kdtree.h"
 #include "grid.h"
 #include "blur.h"
+#include "filters.h"
+#include "image-io.h"
+#include "kernels.h"
+#include "netpbm.h"
+#include "row-reader.h"
 #include "reshaping.h"
+#include "resizing.h"
 #include "palette-parsing.h"
+#include "pipeline.h"
 
 using namespace std;
 
@@ -54,27 +76,14 @@ filesystem::path out_name(filesystem::path path, string const &append){
 	return path.replace_filename(path.stem().string() + "_" + append + path.extension().string());
 }
 
-vector<unsigned char> resize_image(vector<unsigned char> const &data, size_t const old_height, size_t const old_width, size_t const new_height, size_t const new_width, size_t const channels) {
-	size_t const new_size = new_height * new_width * channels;
-	float const v_proportion = static_cast<float>(old_height) / static_cast<float>(new_height);
-	float const h_proportion = static_cast<float>(old_width) / static_cast<float>(new_width);
-	vector<unsigned char> output(new_size);
-
-	for (size_t i = 0; i < new_height; i++) {
-		size_t const new_i = i * new_width;
-		size_t const old_i = i * old_width * v_proportion;
-		for (size_t j = 0; j < new_width; j++) {
-			size_t const old_j = j * h_proportion;
-			for (size_t c = 0; c < channels; c++) {
-				output[(new_i + j) * channels + c] = data[(old_i + old_j) * channels + c];
-			}
-		}
-	}
-
-	return output;
+// '-o' is either the output file or a directory the output goes into with its default name
+filesystem::path resolve_output(filesystem::path const &default_output, filesystem::path const &requested_output){
+	if (requested_output.empty()) return default_output;
+	if (filesystem::is_directory(requested_output)) return requested_output / default_output.filename();
+	return requested_output;
 }
 
-void print_image(int const height, int const width, int const channels, vector<unsigned char> const &data) {
+void print_image(int const height, int const width, int const channels, unsigned char const * data) {
 	//resizing in case the original image is too big
 	size_t constexpr MAX_HEIGHT = 720;
 	size_t constexpr MAX_WIDTH = 1280;
@@ -82,15 +91,17 @@ void print_image(int const height, int const width, int const channels, vector<u
 	size_t new_height, new_width;
 	vector<unsigned char> new_data;
 
-	if (data.size() > MAX_HEIGHT * MAX_WIDTH * channels) {
+	size_t const size = static_cast<size_t>(height) * width * channels;
+
+	if (size > MAX_HEIGHT * MAX_WIDTH * channels) {
 		float const proportion = min(static_cast<float>(MAX_HEIGHT) / static_cast<float>(height), static_cast<float>(MAX_WIDTH) / static_cast<float>(width));
 		new_height = height * proportion;
 		new_width = width * proportion;
-		new_data = resize_image(data, height, width, height * proportion, width * proportion, channels);
+		new_data = resize_image(data, height, width, new_height, new_width, channels);
 	} else {
 		new_height = height;
 		new_width = width;
-		new_data = data;
+		new_data.assign(data, data + size);
 	}
 
 	//encoding in base64
@@ -196,38 +207,70 @@ bool is_extension_supported(filesystem::path const &path) {
 
 // QUANTIZATION LOGIC
 
-vector<array<int, 3>> retrieve_selected_colors(vector<array<int, 3>> &list, size_t const amount, bool const by_brightness = false){
-
-	vector<array<int, 3>> out;
-	size_t const size = list.size();
-	
-	if (by_brightness){
-		vector<int> brightness_list;
-		vector<size_t> brightness_positions;
-		sort_color_list(list, &brightness_list); // it has to be sorted because we want to capture the minimum element, if we do not sort it we will always capture the first pixel instead, and it might not be the minimum
-		for (size_t i = 0; i < amount - 1; i++){
-			for (size_t j = i * size / (amount - 1); j < size; j++){
-				if (brightness_list[j] >= static_cast<int>(i) * 255 / static_cast<int>(amount)){
-					brightness_positions.push_back(j);
-					break;
-				} 
+// Sorting every pixel by brightness only to read a few positions back is not needed, a histogram of
+// the 256 brightness levels tells which level sits at any position of the sorted list
+struct BrightnessHistogram {
+	size_t counts[256] = {};
+	array<int, 3> representative[256];
+
+	// pixels can be added in as many pieces as needed
+	void add(unsigned char const * data, size_t const size, size_t const channels){
+		for (size_t i = 0; i + channels <= size; i += channels){
+			int const level = (data[i] + data[i + 1] + data[i + 2]) / 3;
+			if (counts[level]++ == 0){
+				representative[level] = {data[i], data[i + 1], data[i + 2]};
 			}
 		}
-		
-		for (const auto& pos : brightness_positions){
-			out.push_back(list[pos]);
-		}
+	}
 
-		out.push_back(list[size - 1]);
-	} else {
-		sort_color_list(list);
-		for (size_t i = 0; i < amount; i++){
-			out.push_back(list[i * size / amount]);
+	vector<array<int, 3>> select(size_t const amount, bool const by_brightness) const {
+		// first[k] is the position of the first pixel of brightness k in the sorted list
+		size_t first[257] = {};
+		for (size_t k = 0; k < 256; k++){
+			first[k + 1] = first[k] + counts[k];
 		}
+
+		size_t const count = first[256];
+		vector<array<int, 3>> out;
+		if (count == 0) return out;
+
+		auto at = [&](size_t const position){
+			size_t const level = upper_bound(first, first + 257, position) - first - 1;
+			return representative[level];
+		};
 		
-	}
+		if (by_brightness){
+			for (size_t i = 0; i < amount - 1; i++){
+				// first position after the start of the band with a brightness of at least the threshold
+				size_t const threshold = i * 255 / amount;
+				size_t const position = max(i * count / (amount - 1), first[threshold]);
+				if (position < count){
+					out.push_back(at(position));
+				}
+			}
+
+			out.push_back(at(count - 1));
+		} else {
+			for (size_t i = 0; i < amount; i++){
+				out.push_back(at(i * count / amount));
+			}
+			
+		}
 
-	return out;
+		return out;
+	}
+};
+
+vector<array<int, 3>> retrieve_selected_colors(
+	unsigned char const * data,
+	size_t const size,
+	size_t const channels,
+	size_t const amount,
+	bool const by_brightness = false
+){
+	BrightnessHistogram histogram;
+	histogram.add(data, size, channels);
+	return histogram.select(amount, by_brightness);
 }
 
 void quantize_search(
@@ -248,142 +291,507 @@ void quantize_search(
 	}
 }
 
-bool quantize_to_list_by_mask(Grid<int> const &mask,
-	vector<array<int,3>> const &list,
+// Maps every grey level to the palette color that quantize_to_list gives it, packed as 0x00BBGGRR
+array<uint32_t, 256> list_table(vector<array<int,3>> const &list){
+	array<uint32_t, 256> table{};
+	if (list.empty()) return table;
+
+	for (size_t i = 0; i < table.size(); i++){
+		array<int, 3> const &color = list[(i * (list.size() - 1) + 127) / 255];
+		table[i] = static_cast<uint32_t>(clamp(color[0], 0, 255))
+			| static_cast<uint32_t>(clamp(color[1], 0, 255)) << 8
+			| static_cast<uint32_t>(clamp(color[2], 0, 255)) << 16;
+	}
+
+	return table;
+}
+
+
+// Replaces every pixel with the color of the list at the position of its brightness,
+// the greyscale is computed on the fly instead of going through a separate grid
+bool quantize_to_list(vector<array<int,3>> const &list,
 	Grid<int> * const red,
 	Grid<int> * const green,
 	Grid<int> * const blue
 ){
-
-    for (size_t i = 0; i < red->size(); i++){
-    		size_t const color_pos = (mask.data()[i] * (list.size() - 1) + 127) / 255;
-    		red->data()[i] = list[color_pos][0];
-    		green->data()[i] = list[color_pos][1];
-    		blue->data()[i] = list[color_pos][2];
-    }
+	if (list.empty()) return false;
+
+	array<uint32_t, 256> const table = list_table(list);
+	size_t constexpr CHUNK = 1 << 16;
+
+	parallel_bands(red->size(), CHUNK, [&](size_t const start, size_t const end) {
+		uint32_t const * __restrict lut = table.data();
+		int * __restrict rd = red->raw();
+		int * __restrict gd = green->raw();
+		int * __restrict bd = blue->raw();
+
+		for (size_t i = start; i < end; i++){
+			uint32_t const color = lut[clamp((rd[i] + gd[i] + bd[i]) / 3, 0, 255)];
+			rd[i] = color & 0xFF;
+			gd[i] = (color >> 8) & 0xFF;
+			bd[i] = color >> 16;
+		}
+	});
     
     return true;
 }
 
 
-Grid<int> quantize_to_self(Grid<int> mat, size_t const resolution){
+// The posterized value only depends on the 8 bit input, so every level is computed once
+array<int, 256> self_table(size_t const resolution){
+	array<int, 256> table{};
+	if (resolution < 2) return table;
 
-    for (size_t i = 0; i < mat.size(); i++){
-    	float const cache = floor(static_cast<float>(mat.data()[i]) / 255.0f * static_cast<float>(resolution - 1) + 0.5f);
-        mat.data()[i] = cache * 255.0f / static_cast<float>(resolution - 1);
-    }
-    
-    return mat;
+	for (size_t i = 0; i < table.size(); i++){
+		float const cache = floor(static_cast<float>(i) / 255.0f * static_cast<float>(resolution - 1) + 0.5f);
+		table[i] = cache * 255.0f / static_cast<float>(resolution - 1);
+	}
+
+	return table;
 }
 
 
-int main(int argc, char* argv[]){
+void quantize_to_self(vector<Grid<int> *> const &channels, size_t const resolution){
+	if (channels.empty()) return;
 
-	// PARSING ARGS
-	args_t args = make_default_args();
+	array<int, 256> const table = self_table(resolution);
+	size_t const size = channels[0]->size();
+	size_t constexpr CHUNK = 1 << 16;
 
-	if (!parse_args(argc, argv, &args) || args.help) {
-        print_help(argv[0]);
-        return 1;
-    }
+	//every chunk goes through all the channels while the table stays in L1
+	parallel_bands(size, CHUNK, [&](size_t const start, size_t const end) {
+		int const * __restrict lut = table.data();
 
-	if (args.resolution < 2){
-		cerr << "Resolution must be equal or greater than 2" << endl;
+		for (Grid<int> * const channel : channels){
+			int * __restrict cd = channel->raw();
+			for (size_t i = start; i < end; i++){
+				cd[i] = lut[clamp(cd[i], 0, 255)];
+			}
+		}
+	});
+}
+
+
+// PER PIXEL KERNELS
+// used when no filter needs whole planes, the modes then go from the decoded bytes to the output in one pass
+
+struct SearchKernel {
+	KDTree<int, 3> const &palette;
+
+	void operator()(unsigned char const * in, unsigned char * out) const {
+		array<int, 3> const color = palette.nearest({in[0], in[1], in[2]});
+		out[0] = color[0];
+		out[1] = color[1];
+		out[2] = color[2];
+	}
+};
+
+struct ListKernel {
+	array<uint32_t, 256> table;
+
+	void operator()(unsigned char const * in, unsigned char * out) const {
+		uint32_t const color = table[(in[0] + in[1] + in[2]) / 3];
+		out[0] = color & 0xFF;
+		out[1] = (color >> 8) & 0xFF;
+		out[2] = color >> 16;
+	}
+};
+
+struct SelfKernel {
+	array<int, 256> table;
+
+	void operator()(unsigned char const * in, unsigned char * out) const {
+		unsigned char const r = table[in[0]], g = table[in[1]], b = table[in[2]];
+		out[0] = r;
+		out[1] = g;
+		out[2] = b;
+	}
+};
+
+struct BwKernel {
+	array<int, 256> table;
+
+	void operator()(unsigned char const * in, unsigned char * out) const {
+		unsigned char const grey = table[(in[0] + in[1] + in[2]) / 3];
+		out[0] = grey;
+		out[1] = grey;
+		out[2] = grey;
+	}
+};
+
+
+void draw_outlines(
+	Grid<unsigned char> const &outlines,
+	Grid<int> * const red,
+	Grid<int> * const green,
+	Grid<int> * const blue
+){
+	for (size_t i = 0; i < red->size(); i++){
+		if (outlines.data()[i]){
+			red->data()[i] = 0;
+			green->data()[i] = 0;
+			blue->data()[i] = 0;
+		}
+	}
+}
+
+
+// Everything that only depends on the arguments, loaded once and shared by every image of a batch
+struct Context {
+	vector<array<int, 3>> palette; // sorted by brightness for equidistant
+	optional<KDTree<int, 3>> palette_tree;
+};
+
+bool load_context(args_t const &args, Context &context){
+	string const mode(args.mode);
+	if (mode != "search" && mode != "equidistant") return true;
+
+	context.palette = import_palette(args.palette);
+	if (context.palette.empty()) return false;
+
+	if (mode == "search"){
+		context.palette_tree.emplace(context.palette);
+	} else {
+		sort_color_list(context.palette);
+	}
+
+	return true;
+}
+
+
+// STREAMING
+// PPM, PAM and uncompressed BMP and TGA images go through the program a band of rows at a time. Every
+// band is read along with the rows around it that the filters reach, which are dropped again before
+// writing, so the memory used depends on the width of the image and not on its height
+
+// Calls func(rows, top, bottom, start, end) for every band [start, end) of the image, where rows holds
+// the image rows [top, bottom), that is the band and up to `halo` rows on each side of it
+template <typename F>
+bool for_each_band(RowReader &reader, size_t const band_rows, size_t const halo, F &&func){
+	size_t const height = reader.height();
+	size_t const stride = reader.width() * reader.channels();
+
+	if (!reader.rewind()) return false;
+
+	vector<unsigned char> window((band_rows + 2 * halo) * stride);
+	size_t top = 0, bottom = 0;
+
+	for (size_t start = 0; start < height; start += band_rows){
+		size_t const end = min(height, start + band_rows);
+		size_t const new_top = start > halo ? start - halo : 0;
+		size_t const new_bottom = min(height, end + halo);
+
+		// the rows shared with the previous band move to the front and only the new ones are read
+		memmove(window.data(), window.data() + (new_top - top) * stride, (bottom - new_top) * stride);
+		if (!reader.read_rows(window.data() + (bottom - new_top) * stride, new_bottom - bottom)) return false;
+
+		top = new_top;
+		bottom = new_bottom;
+
+		if (!func(window.data(), top, bottom, start, end)) return false;
+	}
+
+	return true;
+}
+
+
+int stream_image(
+	args_t const &args,
+	Context const &context,
+	filesystem::path const &input_file,
+	filesystem::path const &requested_output
+){
+	string const mode(args.mode);
+	string const filter(args.filter);
+
+	if (args.cartoon > 0 || args.antialiasing > 0 || args.scale != 1.0f || args.print){
+		cerr << "Outlines, antialiasing, scaling and printing are not available with --stream" << endl;
 		return 1;
 	}
 
-	filesystem::path const input_file = args.input_file;
-	if (!is_extension_supported(input_file)) {
-		cout << "Image format not supported" << endl;
+	if (args.blur > 0 && filter != "edges"){
+		cerr << "Only the edges filter is available with --stream" << endl;
 		return 1;
 	}
 
-	string mode(args.mode);
+	RowReader reader;
+	if (!reader.open(input_file)) return 1;
 
-	// IMPORT
-	
-	int width, height, channels;
- 	filesystem::path output_file;
+	size_t const width = reader.width();
+	size_t const channels = reader.channels();
+	size_t const stride = width * channels;
+
+	// the default output keeps the extension of PPM and PAM inputs and is named like them for the others
+	filesystem::path named = input_file;
+	if (!is_netpbm(named)){
+		named.replace_extension(channels == 4 ? ".pam" : ".ppm");
+	}
+
+	if (filesystem::path const target = resolve_output(named, requested_output); !is_netpbm(target)){
+		cerr << "The output of --stream has to be .ppm or .pam: " << target << endl;
+		return 1;
+	}
+
+	// bands start at multiples of the alignment, so the pyramid levels of big blurs line up with the ones of the whole image
+	size_t const alignment = args.blur > 0 ? blur_alignment(args.blur) : 1;
+	auto align = [&](size_t const rows){
+		return (rows + alignment - 1) / alignment * alignment;
+	};
+
+	size_t constexpr BAND_ROWS = 256;
+	size_t const band_rows = align(BAND_ROWS);
+	size_t const halo = align(args.median + (args.blur > 0 ? blur_halo(args.blur) : 0));
+	bool const filtered = args.median > 0 || args.blur > 0;
+
+	EdgeMagnitude const magnitude = args.fast_edges ? EdgeMagnitude::APPROXIMATE : EdgeMagnitude::L2;
+	Grid<int> red, green, blue, alpha;
+
+	// planes of the rows after the median, and their edge strength when they get blurred
+	auto filter_rows = [&](unsigned char const * rows, size_t const count){
+		vectorize_to_rgb(rows, count, width, &red, &green, &blue, channels == 4 ? &alpha : nullptr);
+
+		if (args.median > 0){
+			median_filter({&red, &green, &blue}, args.median);
+		}
+
+		return args.blur > 0 ? sobel_magnitude(rgb_to_greyscale(red, green, blue), magnitude) : Grid<float>();
+	};
+
+	// FIRST PASS
+	// edges are as strong as they are relative to the strongest one of the whole image,
+	// and self-sort takes its colors from the histogram of all of it
+	float edge_max = 0;
+	BrightnessHistogram histogram;
+
+	if (args.blur > 0 || mode == "self-sort"){
+		bool const read = for_each_band(reader, band_rows, halo, [&](unsigned char * rows, size_t const top, size_t const bottom, size_t const start, size_t const end){
+			if (mode == "self-sort"){
+				histogram.add(rows + (start - top) * stride, (end - start) * stride, channels);
+			}
+
+			if (args.blur > 0){
+				Grid<float> const edges = filter_rows(rows, bottom - top);
+				for (size_t i = start; i < end; i++){
+					edge_max = max(edge_max, *max_element(edges[i - top], edges[i - top] + width));
+				}
+			}
+
+			return true;
+		});
 
-	unsigned char const * data = stbi_load(filesystem::path(args.input_file).c_str(), &width, &height, &channels, 0);
+		if (!read) return 1;
+	}
+
+	// SECOND PASS
+	auto stream = [&](auto const &kernel, filesystem::path output_file){
+		output_file = resolve_output(output_file, requested_output);
+
+		NetpbmWriter writer;
+		if (!args.dry && !writer.open(output_file, reader.height(), width, channels)) return 1;
+
+		vector<unsigned char> processed(filtered ? (band_rows + 2 * halo) * stride : 0);
+
+		bool const written = for_each_band(reader, band_rows, halo, [&](unsigned char * rows, size_t const top, size_t const bottom, size_t const start, size_t const end){
+			unsigned char * band = rows + (start - top) * stride;
+
+			if (filtered){
+				Grid<float> edges = filter_rows(rows, bottom - top);
+
+				if (args.blur > 0){
+					if (edge_max > 0){
+						edges *= 1.0f / edge_max;
+					}
+					edges = 1 - edges;
+
+					vector<Grid<int> *> planes = {&red, &green, &blue};
+					if (channels == 4){
+						planes.push_back(&alpha);
+					}
+					blur_channels(planes, args.blur, static_cast<float>(args.blur) / 1.5f, &edges, 3);
+				}
+
+				flatten_into(processed.data(), &red, &green, &blue, channels == 4 ? &alpha : nullptr);
+				band = processed.data() + (start - top) * stride;
+			}
+
+			apply_pixel_kernel(band, band, end - start, width, channels, kernel);
+			return args.dry || writer.write_rows(band, end - start);
+		});
+
+		return written && writer.close() ? 0 : 1;
+	};
+
+	if (mode == "search"){
+		return stream(SearchKernel{*context.palette_tree}, out_name(named, "search_" + string(args.palette)));
+	} else if (mode == "equidistant"){
+		return stream(ListKernel{list_table(context.palette)}, out_name(named, "equidistant_" + string(args.palette)));
+	} else if (mode == "self"){
+		return stream(SelfKernel{self_table(args.resolution)}, out_name(named, "self"));
+	} else if (mode == "self-sort"){
+		return stream(ListKernel{list_table(histogram.select(args.resolution, true))}, out_name(named, "self_sort"));
+	} else if (mode == "bw"){
+		return stream(BwKernel{self_table(args.resolution)}, out_name(named, "bw"));
+	}
+
+	cerr << "Unknown mode: " << mode << endl;
+	return 1;
+}
+
+
+// IMAGE STAGES
+
+struct StbiFree {
+	void operator()(unsigned char * data) const { stbi_image_free(data); }
+};
+
+// An image on its way from decoding through quantization to encoding, every stage can run on another thread
+struct Image {
+	filesystem::path input_file;
+	filesystem::path output_file;
+	int width = 0, height = 0, channels = 0;
+
+	unique_ptr<unsigned char, StbiFree> data;
+	vector<unsigned char> scaled;
+	vector<unsigned char> output;
+	vector<float> output_hdr;
+
+	unsigned char * result = nullptr; // the bytes that get encoded
+	bool hdr_output = false;
+};
+
+bool decode_image(Image &image){
+	if (!is_extension_supported(image.input_file)) {
+		cout << "Image format not supported: " << image.input_file << endl;
+		return false;
+	}
+
+	image.data.reset(load_image(image.input_file, &image.width, &image.height, &image.channels));
 	
-	if (!data) {
-	    cerr << "Failed to load image: " << stbi_failure_reason() << endl;
-	    return 1;
+	if (!image.data) {
+	    cerr << "Failed to load image " << image.input_file << ": " << stbi_failure_reason() << endl;
+	    return false;
+	}
+
+	return true;
+}
+
+bool quantize_image(
+	args_t const &args,
+	Context const &context,
+	Image &image,
+	filesystem::path const &requested_output
+){
+	string mode(args.mode);
+	filesystem::path const &input_file = image.input_file;
+	int &width = image.width, &height = image.height;
+	int const channels = image.channels;
+	filesystem::path &output_file = image.output_file;
+	auto &data = image.data;
+	vector<unsigned char> &scaled = image.scaled;
+
+	// everything after this point reads the pixels, which are the decoded data unless it gets scaled
+	unsigned char * pixels = data.get();
+
+	if (args.scale != 1.0f){
+		int const new_height = max(1, static_cast<int>(lround(height * args.scale)));
+		int const new_width = max(1, static_cast<int>(lround(width * args.scale)));
+
+		scaled = resize_image(data.get(), height, width, new_height, new_width, channels);
+		pixels = scaled.data();
+		height = new_height;
+		width = new_width;
+		data.reset();
 	}
 	
 
+	if (channels != 3 && channels != 4){
+		cerr << "Image is neither RGB nor RGBA: " << input_file << endl;
+		return false;
+	}
+
+	// without filters every mode works pixel by pixel, so the planes are never built
+	bool const per_pixel = args.median == 0 && args.blur == 0 && args.cartoon == 0 && args.antialiasing == 0;
+
+	// the output is written once, straight in the layout and type the encoder takes.
+	// Per pixel modes overwrite the pixels they read, so only one image is ever in memory
+	filesystem::path const target = resolve_output(input_file, requested_output);
+	bool const hdr_output = image.hdr_output = !args.print && target.extension() == ".hdr";
+	bool const in_place = per_pixel && !hdr_output;
+	size_t const output_size = static_cast<size_t>(height) * width * channels;
+
 	Grid<int> red, green, blue, alpha;
-	vector<array<int, 3>> palette;
+	vector<unsigned char> &output = image.output;
+	vector<float> &output_hdr = image.output_hdr;
 
-	// PREPROCESSING
+	// only in place results live in the pixels, the rest get their buffer once the decoded image is freed
+	unsigned char * &result = image.result;
+	result = in_place ? pixels : nullptr;
 
-	if (channels == 3){
-		if (!vectorize_to_rgb(data, height, width, &red, &green, &blue)) {
-			cout << "Could not process image" << endl;
-			return 1;
-		}
-	} else if (channels == 4){
-		if (!vectorize_to_rgb(data, height, width, &red, &green, &blue, &alpha)) {
-			cout << "Could not process image" << endl;
-			return 1;
+	auto run_kernel = [&](auto const &kernel){
+		if (hdr_output){
+			output_hdr.resize(output_size);
+			apply_pixel_kernel(pixels, output_hdr.data(), height, width, channels, kernel);
+		} else {
+			apply_pixel_kernel(pixels, result, height, width, channels, kernel);
 		}
-	} else {
-		cerr << "Image is neither RGB nor RGBA" << endl;
-		return 1;
+	};
+
+	// PREPROCESSING
+
+	if (!per_pixel && !vectorize_to_rgb(pixels, height, width, &red, &green, &blue, channels == 4 ? &alpha : nullptr)) {
+		cout << "Could not process image " << input_file << endl;
+		return false;
 	}
 	
-	if (args.blur > 0){
-		Grid<float> edges = 1 - detect_edges_sobel(rgb_to_greyscale(red, green, blue));
-		Grid<float> kernel = g_kernel(2 * args.blur + 1, static_cast<float>(args.blur) / 1.5f);
-		
-		red = red.convolve(kernel, edges);
-		green = green.convolve(kernel, edges);
-		blue = blue.convolve(kernel, edges);
+	if (args.median > 0){
+		median_filter({&red, &green, &blue}, args.median);
+	}
 
+	if (args.blur > 0){
+		vector<Grid<int> *> planes = {&red, &green, &blue};
 		if (!alpha.empty()){
-			alpha = alpha.convolve(kernel);
+			planes.push_back(&alpha); // alpha is blurred everywhere, it does not take the edge mask
+		}
+
+		string const filter(args.filter);
+
+		if (filter == "edges") {
+			EdgeMagnitude const magnitude = args.fast_edges ? EdgeMagnitude::APPROXIMATE : EdgeMagnitude::L2;
+			Grid<float> edges = 1 - detect_edges_sobel(rgb_to_greyscale(red, green, blue), magnitude);
+
+			blur_channels(planes, args.blur, static_cast<float>(args.blur) / 1.5f, &edges, 3);
+		} else if (filter == "bilateral") {
+			float constexpr RANGE_SIGMA = 32.0f;
+			bilateral_filter(planes, rgb_to_greyscale(red, green, blue), static_cast<float>(args.blur), RANGE_SIGMA);
+		} else if (filter == "guided") {
+			float constexpr EPSILON = 0.01f;
+			guided_filter(planes, rgb_to_greyscale(red, green, blue), args.blur, EPSILON);
+		} else {
+			cerr << "Unknown filter: " << filter << endl;
+			return false;
 		}
 	}
 
+	Grid<unsigned char> outlines;
+
+	if (args.cartoon > 0){
+		int constexpr OUTLINE_THRESHOLD = 4;
+		outlines = detect_outlines(rgb_to_greyscale(red, green, blue), args.cartoon, OUTLINE_THRESHOLD);
+	}
+
 
 	// PROCESSING
 	if (mode == "search"){ // TODO make resolution work by finding the farthest points apart from each other in the 3D set that is the palette
 	
-		palette = import_palette(args.palette);
-		if (palette.empty()) return 1;
-		KDTree<int, 3> palette_tree(palette);
+		KDTree<int, 3> const &palette_tree = *context.palette_tree;
 
 		constexpr size_t MAX_SIZE_PER_THREAD = 720 * 1280;
-		if (red.size() > MAX_SIZE_PER_THREAD * 3 / 2) {
-			size_t const thread_count = red.size() / MAX_SIZE_PER_THREAD;
-			size_t const thread_size = red.size() / thread_count;
-			vector<thread> pool;
-			pool.reserve(thread_count);
-
-			for (size_t i = 0; i < thread_count - 1; i++) {
-				pool.emplace_back(
-					quantize_search,
-					ref(palette_tree),
-					red.raw() + thread_size * i,
-					green.raw() + thread_size * i,
-					blue.raw() + thread_size * i,
-					thread_size);
-			}
-
-			size_t last_index = thread_size * (thread_count - 1);
-			quantize_search(palette_tree,
-				red.raw() + last_index,
-				green.raw() + last_index,
-				blue.raw() + last_index,
-				red.size() - last_index);
-
-			for (auto &floaty : pool) { //called it floaty, but I mean a thread, just could not use the symbol
-				floaty.join();
-			}
-
+		if (per_pixel) {
+			run_kernel(SearchKernel{palette_tree});
 		} else {
-			quantize_search(palette_tree, red.raw(), green.raw(), blue.raw(), red.size());
+			parallel_bands(red.size(), MAX_SIZE_PER_THREAD, [&](size_t const start, size_t const end) {
+				quantize_search(palette_tree, red.raw() + start, green.raw() + start, blue.raw() + start, end - start);
+			});
 		}
 		
 		output_file = out_name(input_file, "search_" + string(args.palette));
@@ -391,45 +799,64 @@ int main(int argc, char* argv[]){
 		
 	} else if (mode == "equidistant"){
 	
-		Grid<int> grey = rgb_to_greyscale(red, green, blue);
-		palette = import_palette(args.palette);
-		if (palette.empty()) return 1;
-		
-		sort_color_list(palette);
-		quantize_to_list_by_mask(grey, palette, &red, &green, &blue);
+		if (per_pixel) {
+			run_kernel(ListKernel{list_table(context.palette)});
+		} else {
+			quantize_to_list(context.palette, &red, &green, &blue);
+		}
 		
 		output_file = out_name(input_file, "equidistant_" + string(args.palette));
 
 		
 	} else if (mode == "self"){
 	
-		vectorize_to_rgb(data, width, height, &red, &green, &blue);
-
-		red = quantize_to_self(red, args.resolution);
-		green = quantize_to_self(green, args.resolution);
-		blue = quantize_to_self(blue, args.resolution);
+		if (per_pixel) {
+			run_kernel(SelfKernel{self_table(args.resolution)});
+		} else {
+			quantize_to_self({&red, &green, &blue}, args.resolution);
+		}
 
 		output_file = out_name(input_file, "self");
 
 		
 	} else if (mode == "self-sort"){
 	
-		vector<array<int, 3>> color_list = vectorize_to_color_list(data, width * height * channels, channels);
-		color_list = retrieve_selected_colors(color_list, args.resolution, true);
-		
-		Grid<int> grey = rgb_to_greyscale(red, green, blue);
-		quantize_to_list_by_mask(grey, color_list, &red, &green, &blue);
+		// the palette only depends on statistics of the whole image, so a quarter size copy
+		// has almost the same one with a sixteenth of the pixels to go through
+		unsigned char const * statistics = pixels;
+		size_t statistics_size = width * height * channels;
+		vector<unsigned char> sample;
+
+		if (args.sample){
+			size_t const sample_height = max(1, height / 4);
+			size_t const sample_width = max(1, width / 4);
+			sample = resize_image(pixels, height, width, sample_height, sample_width, channels);
+			statistics = sample.data();
+			statistics_size = sample.size();
+		}
+
+		vector<array<int, 3>> color_list = retrieve_selected_colors(statistics, statistics_size, channels, args.resolution, true);
+		if (per_pixel) {
+			run_kernel(ListKernel{list_table(color_list)});
+		} else {
+			quantize_to_list(color_list, &red, &green, &blue);
+		}
 		
 		output_file = out_name(input_file, "self_sort");
 
 		
 	} else if (mode == "bw") {
 
-		Grid<int> grey = quantize_to_self(rgb_to_greyscale(red, green, blue), args.resolution);
+		if (per_pixel) {
+			run_kernel(BwKernel{self_table(args.resolution)});
+		} else {
+			Grid<int> grey = rgb_to_greyscale(red, green, blue);
+			quantize_to_self({&grey}, args.resolution);
 
-		red = grey;
-		green = grey;
-		blue = grey;
+			red = grey;
+			green = grey;
+			blue = grey;
+		}
 
 		output_file = out_name(input_file, "bw");
 
@@ -454,67 +881,384 @@ int main(int argc, char* argv[]){
 // 		output_file = out_name(input_file, "edges");
 		
 	} else {
-		print_help(argv[0]);
-        return 1;
+		cerr << "Unknown mode: " << mode << endl;
+        return false;
 	}
 
-	delete[] data;
+	if (!in_place){
+		data.reset();
+		vector<unsigned char>().swap(scaled);
+	}
 	
 	// POSTPROCESSING
 
-	if (args.antialiasing > 0){ // TODO make actual antialiasing
-		Grid<int> grey = rgb_to_greyscale(red, green, blue);
-		Grid<float> edges_h = detect_edges_horizontal(grey);
-		Grid<float> edges_v = detect_edges_vertical(grey);
+	if (!outlines.empty()){
+		draw_outlines(outlines, &red, &green, &blue);
 	}
 
-	
-	if (args.output_file[0] != '\0'){
-		output_file = filesystem::path(args.output_file);
+	if (args.antialiasing > 0){
+		antialias(&red, &green, &blue, args.antialiasing);
 	}
 
-	// EXPORTING
+	
+	output_file = resolve_output(output_file, requested_output);
 
-	vector<unsigned char> output;
+	// EXPORTING
 
-	if (channels == 4) {
-		output = flatten(&red, &green, &blue, &alpha);
-	} else {
-		output = flatten(&red, &green, &blue);
+	// the planes hold the result, the buffer for it is only needed once the decoded image is gone
+	if (!per_pixel) {
+		Grid<int> const * const alpha_plane = channels == 4 ? &alpha : nullptr;
+		if (hdr_output) {
+			output_hdr.resize(output_size);
+			flatten_into(output_hdr.data(), &red, &green, &blue, alpha_plane);
+		} else {
+			output.resize(output_size);
+			result = output.data();
+			flatten_into(result, &red, &green, &blue, alpha_plane);
+		}
 	}
 
-	if (args.print) print_image(height, width, channels, output);
-	if (args.dry) return 0;
+	return true;
+}
 
-	if (!args.print || !string(args.output_file).empty()) {
+bool encode_image(args_t const &args, Image &image, filesystem::path const &requested_output){
+	int const width = image.width, height = image.height, channels = image.channels;
+	unsigned char const * const result = image.result;
+	filesystem::path &output_file = image.output_file;
+	size_t const output_size = static_cast<size_t>(height) * width * channels;
+
+	if (args.print) print_image(height, width, channels, result);
+	if (args.dry) return true;
+
+	if (!args.print || !requested_output.empty()) {
 
 		int error;
 
 		if (filesystem::path extension = output_file.extension(); extension == ".png") {
-			error = stbi_write_png(output_file.c_str(), width, height, channels, output.data(), 0);
+			error = stbi_write_png(output_file.c_str(), width, height, channels, result, 0);
 		} else if (extension == ".bmp" || extension == ".dib") {
-			error = stbi_write_bmp(output_file.c_str(), width, height, channels, output.data());
+			error = stbi_write_bmp(output_file.c_str(), width, height, channels, result);
 		} else if (extension == ".tga" || extension == ".icb" || extension == ".vda") {
-			error = stbi_write_tga(output_file.c_str(), width, height, channels, output.data());
+			error = stbi_write_tga(output_file.c_str(), width, height, channels, result);
 		} else if (extension == ".jpg" || extension == ".jpeg" || extension == ".jpe" || extension == ".jif" || extension == ".jfif" || extension == ".jfi") {
-			error = stbi_write_jpg(output_file.c_str(), width, height, channels, output.data(), static_cast<int>(args.quality));
+			error = stbi_write_jpg(output_file.c_str(), width, height, channels, result, static_cast<int>(args.quality));
 		} else if (extension == ".hdr") {
-			vector<float> output_hdr;
-			for (auto const &value : output) {
-				output_hdr.emplace_back(static_cast<float>(value) / 255.0f);
+			if (!image.hdr_output) { // printing needs the bytes, so the floats are made from them
+				image.output_hdr.resize(output_size);
+				for (size_t i = 0; i < output_size; i++) {
+					image.output_hdr[i] = static_cast<float>(result[i]) / 255.0f;
+				}
 			}
-			error = stbi_write_hdr(output_file.c_str(), width, height, channels, output_hdr.data());
+			error = stbi_write_hdr(output_file.c_str(), width, height, channels, image.output_hdr.data());
 		} else {
 			cout << "Format of the image to export could not be recognized\n" << "Exporting as png..." << endl;
-			error = stbi_write_png(output_file.replace_extension(".png").c_str(), width, height, channels, output.data(), 0);
+			error = stbi_write_png(output_file.replace_extension(".png").c_str(), width, height, channels, result, 0);
 		}
 		
 		if (!error) {
-			cerr << "Could not export image." << endl;
-			return error;
+			cerr << "Could not export image " << output_file << endl;
+			return false;
 		}
 
 	}
 	    
+	return true;
+}
+
+int process_image(
+	args_t const &args,
+	Context const &context,
+	filesystem::path const &input_file,
+	filesystem::path const &requested_output
+){
+	if (args.stream){
+		return stream_image(args, context, input_file, requested_output);
+	}
+
+	Image image;
+	image.input_file = input_file;
+
+	bool const done = decode_image(image)
+		&& quantize_image(args, context, image, requested_output)
+		&& encode_image(args, image, requested_output);
+
+	return done ? 0 : 1;
+}
+
+
+// BATCH
+
+// Inputs are files, directories whose supported images are all taken in name order,
+// or .txt lists with one path per line. Streaming takes the images of directories it can read by rows instead
+bool collect_inputs(filesystem::path const &path, bool const stream, vector<filesystem::path> &inputs){
+	error_code error;
+
+	if (filesystem::is_directory(path, error)){
+		vector<filesystem::path> found;
+		for (auto const &entry : filesystem::directory_iterator(path, error)){
+			if (entry.is_regular_file(error) && (stream ? is_streamable(entry.path()) : is_extension_supported(entry.path()))){
+				found.push_back(entry.path());
+			}
+		}
+		if (error){
+			cerr << "Could not read directory " << path << ": " << error.message() << endl;
+			return false;
+		}
+
+		sort(found.begin(), found.end());
+		inputs.insert(inputs.end(), found.begin(), found.end());
+		return true;
+	}
+
+	if (path.extension() == ".txt"){
+		ifstream list(path);
+		if (!list){
+			cerr << "Could not open input list " << path << endl;
+			return false;
+		}
+
+		string line;
+		while (getline(list, line)){
+			line = clean_line(line);
+			if (!line.empty()) inputs.emplace_back(line);
+		}
+		return true;
+	}
+
+	inputs.push_back(path);
+	return true;
+}
+
+// Every argument after the mode that is neither a flag nor the value of one is another input,
+// they are taken out of argv so the parser only sees the options
+vector<char *> split_inputs(int argc, char* argv[], vector<filesystem::path> &extra_inputs){
+	#define OPTIONAL_ARG(type, name, default, flag, label, description, formatter, parser) flag,
+	static char const * const VALUE_FLAGS[] = { OPTIONAL_ARGS };
+	#undef OPTIONAL_ARG
+
+	vector<char *> options(argv, argv + min(argc, 1 + REQUIRED_ARG_COUNT));
+
+	for (int i = 1 + REQUIRED_ARG_COUNT; i < argc; i++){
+		bool const takes_value = any_of(begin(VALUE_FLAGS), end(VALUE_FLAGS), [&](char const *flag) {
+			return strcmp(argv[i], flag) == 0;
+		});
+
+		if (takes_value){
+			options.push_back(argv[i]);
+			if (i + 1 < argc) options.push_back(argv[++i]);
+		} else if (argv[i][0] == '-' && argv[i][1] != '\0'){
+			options.push_back(argv[i]);
+		} else {
+			extra_inputs.emplace_back(argv[i]);
+		}
+	}
+
+	return options;
+}
+
+// Threads of every stage of a pipeline, the queue in front of a stage holds as many images as it has threads
+struct PipelineShape {
+	size_t decode_threads;
+	size_t process_threads;
+	size_t process_budget; // thread_budget of the quantization threads, 0 for all the cores
+	size_t encode_threads;
+};
+
+struct BatchTimes {
+	StageTimes decode, process, encode;
+	int64_t wall = 0;
+};
+
+// Decoding, quantization and encoding run as a pipeline, so while one image is quantized the next
+// one is decoded and the last one encoded. A stage waits when the queue after it is full, so at most
+// an image per thread plus one per queue slot is in memory at once. Returns the failures
+size_t run_pipeline(
+	args_t const &args,
+	Context const &context,
+	vector<filesystem::path> const &inputs,
+	filesystem::path const &output_directory,
+	PipelineShape const &shape,
+	BatchTimes &times
+){
+	if (inputs.empty()) return 0;
+
+	BoundedQueue<Image> pending(inputs.size()), decoded(shape.process_threads), quantized(shape.encode_threads);
+	for (auto const &input : inputs){
+		Image image;
+		image.input_file = input;
+		pending.push(std::move(image));
+	}
+	pending.close();
+
+	atomic<size_t> failures(0);
+	vector<thread> pool;
+
+	auto const start = chrono::steady_clock::now();
+
+	start_stage(pool, pending, &decoded, shape.decode_threads, 1, times.decode, [&](Image &image) {
+		if (decode_image(image)) return true;
+		failures++;
+		return false;
+	});
+	start_stage(pool, decoded, &quantized, shape.process_threads, shape.process_budget, times.process, [&](Image &image) {
+		if (quantize_image(args, context, image, output_directory)) return true;
+		failures++;
+		return false;
+	});
+	start_stage(pool, quantized, static_cast<BoundedQueue<Image> *>(nullptr), shape.encode_threads, 1, times.encode, [&](Image &image) {
+		if (!encode_image(args, image, output_directory)) failures++;
+		image = Image(); // the buffers are freed here rather than when the next image replaces them
+		return false;
+	});
+
+	for (auto &worker : pool){
+		worker.join();
+	}
+
+	int64_t const wall = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	times.wall += wall;
+	times.decode.available += wall * shape.decode_threads;
+	times.process.available += wall * shape.process_threads;
+	times.encode.available += wall * shape.encode_threads;
+
+	return failures;
+}
+
+void report_times(BatchTimes const &times, size_t const images){
+	auto report = [&](char const * name, StageTimes const &stage){
+		auto percent = [&](int64_t const nanoseconds) {
+			return stage.available > 0 ? lround(100.0 * nanoseconds / stage.available) : 0;
+		};
+
+		cerr << name << ": "
+			<< percent(stage.busy) << "% busy, "
+			<< percent(stage.starved) << "% waiting for images, "
+			<< percent(stage.blocked) << "% waiting for space" << endl;
+	};
+
+	cerr << images << " images in " << lround(times.wall / 1e6) << "ms" << endl;
+	report("decode", times.decode);
+	report("quantize", times.process);
+	report("encode", times.encode);
+}
+
+// Small images are quantized one per core, which skips the thread startup and the synchronization of
+// splitting an image that takes a few milliseconds. Bigger ones have enough rows to split between
+// the cores, so they are quantized one after the other with every core
+int run_batch(
+	args_t const &args,
+	Context const &context,
+	vector<filesystem::path> const &inputs,
+	filesystem::path const &output_directory
+){
+	size_t constexpr LARGE_PIXELS = 4 * 1024 * 1024;
+
+	size_t failures = 0;
+
+	// streaming reads and writes as it goes, so there is nothing to overlap
+	if (args.stream){
+		for (auto const &input : inputs){
+			if (process_image(args, context, input, output_directory) != 0) failures++;
+		}
+	} else {
+		vector<filesystem::path> small, large;
+		for (auto const &input : inputs){
+			int width, height, channels;
+			bool const known = stbi_info(input.c_str(), &width, &height, &channels);
+			float const scale = args.scale * args.scale;
+
+			if (known && static_cast<size_t>(width) * height * scale < LARGE_PIXELS){
+				small.push_back(input);
+			} else {
+				large.push_back(input);
+			}
+		}
+
+		// every stage can take all the cores for small images, whichever one is behind gets them.
+		// Big ones do not depend on the cores, one decoding, one queued, one quantized with every
+		// core, one queued and two encoding keeps at most six of them in memory
+		size_t const cores = thread_count();
+		PipelineShape constexpr LARGE_SHAPE = {1, 1, 0, 2};
+
+		BatchTimes times;
+		failures += run_pipeline(args, context, small, output_directory, {cores, cores, 1, cores}, times);
+		failures += run_pipeline(args, context, large, output_directory, LARGE_SHAPE, times);
+		report_times(times, inputs.size());
+	}
+
+	if (failures > 0){
+		cerr << failures << " of " << inputs.size() << " images failed" << endl;
+		return 1;
+	}
+
 	return 0;
 }
+
+
+int main(int argc, char* argv[]){
+
+	// PARSING ARGS
+	args_t args = make_default_args();
+	vector<filesystem::path> extra_inputs;
+	vector<char *> options = split_inputs(argc, argv, extra_inputs);
+
+	if (!parse_args(static_cast<int>(options.size()), options.data(), &args) || args.help) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+	string const mode(args.mode);
+	if (mode != "search" && mode != "equidistant" && mode != "self" && mode != "self-sort" && mode != "bw"){
+		print_help(argv[0]);
+		return 1;
+	}
+
+	if (args.resolution < 2){
+		cerr << "Resolution must be equal or greater than 2" << endl;
+		return 1;
+	}
+
+	if (args.scale <= 0){
+		cerr << "Scale must be greater than 0" << endl;
+		return 1;
+	}
+
+	vector<filesystem::path> inputs;
+	if (!collect_inputs(args.input_file, args.stream, inputs)) return 1;
+	for (auto const &input : extra_inputs){
+		if (!collect_inputs(input, args.stream, inputs)) return 1;
+	}
+
+	if (inputs.empty()){
+		cerr << "No input images found" << endl;
+		return 1;
+	}
+
+	set_grid_memory_limit(static_cast<size_t>(args.max_memory) << 20);
+
+	Context context;
+	if (!load_context(args, context)) return 1;
+
+	filesystem::path const output(args.output_file);
+
+	bool const batch = inputs.size() > 1 || filesystem::is_directory(args.input_file) || !extra_inputs.empty();
+	if (!batch){
+		return process_image(args, context, inputs.front(), output);
+	}
+
+	if (args.print){
+		cerr << "Printing is not supported with multiple inputs" << endl;
+		return 1;
+	}
+
+	if (!output.empty()){
+		error_code error;
+		filesystem::create_directories(output, error);
+		if (!filesystem::is_directory(output)){
+			cerr << "Output of multiple inputs must be a directory: " << output << endl;
+			return 1;
+		}
+	}
+
+	return run_batch(args, context, inputs, output);
+}
@@ -1,7 +1,12 @@
 #include <cmath>
+#include <vector>
+#include <algorithm>
+#include <mutex>
 
 #include "grid.h"
 #include "blur.h"
+#include "parallel.h"
+#include "pyramid.h"
 
 float gaus(float x, float deviation){
 	x = exp(-(x * x) / (2 * deviation * deviation));
@@ -28,53 +33,290 @@ Grid<float> g_kernel(size_t size, float deviation){
 	return kernel;
 }
 
+std::vector<float> g_kernel_1d(size_t size, float deviation){
+	std::vector<float> kernel(size);
+	float sum = 0;
+	float cen = floor(size / 2);
+
+	for (size_t i = 0; i < size; i++){
+		kernel[i] = gaus(i - cen, deviation);
+		sum += kernel[i];
+	}
+
+	for (auto &value : kernel){
+		value /= sum;
+	}
+
+	return kernel;
+}
+
+std::vector<int> g_kernel_fixed(size_t size, float deviation, unsigned shift){
+	std::vector<float> const weights = g_kernel_1d(size, deviation);
+	std::vector<int> kernel(size);
+	int const one = 1 << shift;
+	int sum = 0;
+
+	for (size_t i = 0; i < size; i++){
+		kernel[i] = static_cast<int>(std::lround(weights[i] * one));
+		sum += kernel[i];
+	}
+
+	// rounding leaves the total a few units off, the center absorbs the difference
+	kernel[size / 2] += one - sum;
+
+	return kernel;
+}
+
 
 // EDGE DETECTION LOGIC
 
-Grid<int> dog(Grid<int> const mat, float s_sigma){
-	float b_sigma = 1.6 * s_sigma;
-	int kernel_radius = 3 * b_sigma;
-	Grid<int> out(mat.height(), mat.width());
+// smallest radius worth blurring on a coarser pyramid level
+static size_t constexpr BLUR_MIN_RADIUS = 8;
+
+size_t blur_halo(size_t const radius){
+	// reducing to a level and expanding back reach about 3 << level rows past the blur itself
+	size_t const level = Pyramid<int>::level_for(radius, BLUR_MIN_RADIUS);
+	return radius + (4 << level);
+}
+
+size_t blur_alignment(size_t const radius){
+	return static_cast<size_t>(1) << Pyramid<int>::level_for(radius, BLUR_MIN_RADIUS);
+}
+
+void blur_channels(
+	std::vector<Grid<int> *> const &channels,
+	size_t radius,
+	float sigma,
+	Grid<float> const * mask,
+	size_t masked
+){
+	unsigned constexpr SHIFT = 10;
+
+	size_t const level = Pyramid<int>::level_for(radius, BLUR_MIN_RADIUS);
+
+	if (level == 0){
+		std::vector<int> const kernel = g_kernel_fixed(2 * radius + 1, sigma, SHIFT);
+		convolve_channels(channels, kernel, mask, masked, 2 * SHIFT);
+		return;
+	}
+
+	// big radii blur the coarse level of a pyramid with a proportionally smaller kernel.
+	// Thin images stop reducing once a side is 1, the kernel follows the levels that were built
+	std::vector<Grid<int>> coarse;
+	std::vector<Grid<int> *> coarse_channels;
+	coarse.reserve(channels.size());
+	size_t built = level;
+
+	for (auto const channel : channels){
+		Pyramid<int> const pyramid(*channel, level);
+		built = pyramid.levels();
+		coarse.push_back(pyramid.top());
+		coarse_channels.push_back(&coarse.back());
+	}
+
+	float const scale = 1 << built;
+	std::vector<int> const kernel = g_kernel_fixed(2 * (radius >> built) + 1, sigma / scale, SHIFT);
+
+	convolve_channels(coarse_channels, kernel, nullptr, 0, 2 * SHIFT);
+
+	for (size_t c = 0; c < channels.size(); c++){
+		Grid<int> blurred = Pyramid<int>::expand(coarse[c], channels[c]->height(), channels[c]->width());
+
+		if (mask && c < masked){
+			int constexpr ONE = 1 << 8;
+			int* __restrict od = channels[c]->raw();
+			const int* __restrict bd = blurred.raw();
+			const float* __restrict md = mask->raw();
+
+			for (size_t i = 0; i < blurred.size(); i++){
+				int const weight = static_cast<int>(md[i] * ONE + 0.5f);
+				od[i] = (bd[i] * weight + od[i] * (ONE - weight) + ONE / 2) >> 8;
+			}
+		} else {
+			*channels[c] = std::move(blurred);
+		}
+	}
+}
+
+// Big sigma blur minus small sigma blur, blurring by s and then by sqrt(b^2 - s^2) is the
+// same as blurring by b, so the big blur starts from the small one with a shorter kernel
+static Grid<int> dog_direct(Grid<int> const &mat, float const s_sigma){
+	unsigned constexpr SHIFT = 10;
+
+	float const b_sigma = 1.6 * s_sigma;
+	float const step_sigma = sqrt(b_sigma * b_sigma - s_sigma * s_sigma);
+
+	auto kernel = [](float const sigma){
+		size_t const radius = ceil(3 * sigma);
+		return g_kernel_fixed(2 * radius + 1, sigma, SHIFT);
+	};
+
+	Grid<int> blurred_small_sigma = mat;
+	convolve_channels<int>({&blurred_small_sigma}, kernel(s_sigma), nullptr, 1, 2 * SHIFT);
+
+	Grid<int> blurred_big_sigma = blurred_small_sigma;
+	convolve_channels<int>({&blurred_big_sigma}, kernel(step_sigma), nullptr, 1, 2 * SHIFT);
+
+	return blurred_big_sigma -= blurred_small_sigma;
+}
+
+// Big sigmas are found on a coarse level of a pyramid and brought back up. The level is chosen
+// once, thin images build fewer levels than asked for and get a proportionally bigger sigma
+static Grid<int> dog_difference(Grid<int> const &mat, float const s_sigma){
+	float constexpr MIN_SIGMA = 2;
+
+	size_t const level = Pyramid<int>::level_for(s_sigma, MIN_SIGMA);
+	if (level == 0) return dog_direct(mat, s_sigma);
+
+	Pyramid<int> const pyramid(mat, level);
+	if (pyramid.levels() == 0) return dog_direct(mat, s_sigma);
+
+	float const scale = 1 << pyramid.levels();
+	return Pyramid<int>::expand(dog_direct(pyramid.top(), s_sigma / scale), mat.height(), mat.width());
+}
 
-	Grid<int> blurred_big_sigma = mat.convolve(g_kernel(2 * kernel_radius + 1, b_sigma));
-	Grid<int> blurred_small_sigma = mat.convolve(g_kernel(2 * kernel_radius + 1, s_sigma));
+Grid<int> dog(Grid<int> const mat, float s_sigma){
+	Grid<int> out = dog_difference(mat, s_sigma);
 
 	int max = 0;
 	
-	for (size_t i = 0; i < out.height(); i++){
-		for (size_t j = 0; j < out.width(); j++){
-			out[i][j] = abs(blurred_big_sigma[i][j] - blurred_small_sigma[i][j]);
-			if (max < out[i][j]){max = out[i][j];}
-		}
+	for (size_t i = 0; i < out.size(); i++){
+		out.data()[i] = abs(out.data()[i]);
+		if (max < out.data()[i]){max = out.data()[i];}
 	}
 
-	out *= float(255) / float(max);
+	if (max > 0) {
+		out *= float(255) / float(max);
+	}
 
 	return out;
 	
 }
 
+Grid<unsigned char> detect_outlines(Grid<int> const &mat, float sigma, int threshold){
+	Grid<int> const difference = dog_difference(mat, sigma);
+	Grid<unsigned char> out(mat.height(), mat.width());
 
-Grid<float> detect_edges_sobel(Grid<float> const &mat){
-	std::vector<int> const sobel_1 = { 1, 2, 1 };
-	std::vector<int> const sobel_2 = { -1, 0, 1 };
+	const int* __restrict dd = difference.raw();
+	unsigned char* __restrict od = out.raw();
 
-	Grid<float> horizontal = mat.convolve(sobel_1, sobel_2);
-	Grid<float> vertical = mat.convolve(sobel_2, sobel_1);
+	// the big blur is brighter than the small one on the dark side of an edge
+	for (size_t i = 0; i < out.size(); i++){
+		od[i] = dd[i] > threshold;
+	}
 
-	float max = 0;
-	for (size_t i = 0; i < horizontal.height(); i++){
-		for (size_t j = 0; j < horizontal.width(); j++){
-			horizontal[i][j] = sqrt(horizontal[i][j] * horizontal[i][j] + vertical[i][j] * vertical[i][j]);
-			if (max < horizontal[i][j]){
-				max = horizontal[i][j];
+	return out;
+}
+
+
+template <EdgeMagnitude M>
+static inline float gradient_magnitude(float const gx, float const gy){
+	if constexpr (M == EdgeMagnitude::L1) {
+		return std::fabs(gx) + std::fabs(gy);
+	} else if constexpr (M == EdgeMagnitude::APPROXIMATE) {
+		// alpha max plus beta min, within 4% of the euclidean magnitude
+		float const a = std::fabs(gx);
+		float const b = std::fabs(gy);
+		return 0.96043387f * std::max(a, b) + 0.39782473f * std::min(a, b);
+	} else {
+		return std::sqrt(gx * gx + gy * gy);
+	}
+}
+
+// Single sweep 3x3 sobel, each band keeps three zero padded rows of the input and
+// writes the gradient magnitude straight into out, returning the maximum it found
+template <EdgeMagnitude M, typename T>
+static float sobel_band(Grid<T> const &mat, Grid<float> &out, size_t const start, size_t const end){
+	size_t const height = mat.height();
+	size_t const width = mat.width();
+
+	std::vector<float> rows[3] = {
+		std::vector<float>(width + 2, 0.0f),
+		std::vector<float>(width + 2, 0.0f),
+		std::vector<float>(width + 2, 0.0f)
+	};
+
+	auto load = [&](std::vector<float> &row, size_t const y){
+		if (y >= height) {
+			std::fill(row.begin(), row.end(), 0.0f);
+		} else {
+			const T* __restrict src = mat[y];
+			float* __restrict dst = row.data() + 1;
+			for (size_t x = 0; x < width; x++){
+				dst[x] = src[x];
 			}
 		}
+	};
+
+	// row index -1 wraps around to SIZE_MAX, which load treats as padding
+	load(rows[0], start - 1);
+	load(rows[1], start);
+
+	float max = 0;
+
+	for (size_t y = start; y < end; y++){
+		load(rows[(y - start + 2) % 3], y + 1);
+
+		const float* __restrict a = rows[(y - start) % 3].data() + 1;
+		const float* __restrict m = rows[(y - start + 1) % 3].data() + 1;
+		const float* __restrict b = rows[(y - start + 2) % 3].data() + 1;
+		float* __restrict od = out[y];
+
+		for (size_t x = 0; x < width; x++){
+			float const gx = (a[x + 1] - a[x - 1]) + 2 * (m[x + 1] - m[x - 1]) + (b[x + 1] - b[x - 1]);
+			float const gy = (b[x - 1] + 2 * b[x] + b[x + 1]) - (a[x - 1] + 2 * a[x] + a[x + 1]);
+			od[x] = gradient_magnitude<M>(gx, gy);
+			max = std::max(max, od[x]);
+		}
 	}
 
-	horizontal /= max;
+	return max;
+}
+
+template <typename T>
+static Grid<float> sobel(Grid<T> const &mat, EdgeMagnitude const magnitude, bool const normalize = true){
+	Grid<float> out(mat.height(), mat.width());
+	if (out.empty()) return out;
+
+	float max = 0;
+	std::mutex max_lock;
+
+	size_t constexpr BAND_HEIGHT = 64;
+	parallel_bands(mat.height(), BAND_HEIGHT, [&](size_t const start, size_t const end){
+		float band_max;
+
+		switch (magnitude) {
+			case EdgeMagnitude::L1:
+				band_max = sobel_band<EdgeMagnitude::L1>(mat, out, start, end);
+				break;
+			case EdgeMagnitude::APPROXIMATE:
+				band_max = sobel_band<EdgeMagnitude::APPROXIMATE>(mat, out, start, end);
+				break;
+			default:
+				band_max = sobel_band<EdgeMagnitude::L2>(mat, out, start, end);
+		}
+
+		std::lock_guard<std::mutex> lock(max_lock);
+		max = std::max(max, band_max);
+	});
+
+	if (normalize && max > 0) {
+		out *= 1.0f / max;
+	}
+
+	return out;
+}
+
+Grid<float> detect_edges_sobel(Grid<float> const &mat, EdgeMagnitude const magnitude){
+	return sobel(mat, magnitude);
+}
+
+Grid<float> detect_edges_sobel(Grid<int> const &mat, EdgeMagnitude const magnitude){
+	return sobel(mat, magnitude);
+}
 
-	return horizontal;
+Grid<float> sobel_magnitude(Grid<int> const &mat, EdgeMagnitude const magnitude){
+	return sobel(mat, magnitude, false);
 }
 
 Grid<float> detect_edges_horizontal(Grid<float> const &mat){
@@ -0,0 +1,603 @@
+#include <cmath>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <limits>
+
+#include "grid.h"
+#include "filters.h"
+#include "parallel.h"
+
+
+// BILATERAL GRID
+
+using GridWeights = std::array<float, 5>;
+
+// [1 4 6 4 1] / 16, a blur of about one cell
+static GridWeights constexpr BINOMIAL_WEIGHTS = { 1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16, 1.0f / 16 };
+
+// Five taps of a gaussian narrower than a cell, for sigmas smaller than the cells
+static GridWeights narrow_weights(float const sigma){
+	GridWeights weights;
+	float sum = 0;
+
+	for (size_t t = 0; t < 5; t++){
+		float const distance = static_cast<float>(t) - 2;
+		weights[t] = std::exp(-distance * distance / (2 * sigma * sigma));
+		sum += weights[t];
+	}
+
+	for (auto &weight : weights){
+		weight /= sum;
+	}
+
+	return weights;
+}
+
+// Blurs every line of `count` cells spaced `stride` floats apart with five weights,
+// each cell holds `cell` floats that are blurred independently
+static void blur_grid_lines(
+	float * const data,
+	size_t const lines,
+	size_t const line_stride,
+	size_t const count,
+	size_t const stride,
+	size_t const cell,
+	GridWeights const &weights
+){
+	parallel_bands(lines, 64, [&](size_t const start, size_t const end){
+		std::vector<float> line((count + 4) * cell, 0.0f);
+
+		for (size_t l = start; l < end; l++){
+			float* __restrict ld = line.data();
+			float* __restrict base = data + l * line_stride;
+
+			for (size_t i = 0; i < count; i++){
+				std::copy_n(base + i * stride, cell, ld + (i + 2) * cell);
+			}
+
+			for (size_t i = 0; i < count; i++){
+				float* __restrict dst = base + i * stride;
+				std::fill_n(dst, cell, 0.0f);
+
+				for (size_t t = 0; t < 5; t++){
+					const float* __restrict src = ld + (i + t) * cell;
+					for (size_t c = 0; c < cell; c++){
+						dst[c] += src[c] * weights[t];
+					}
+				}
+			}
+		}
+	});
+}
+
+void bilateral_filter(
+	std::vector<Grid<int> *> const &channels,
+	Grid<int> const &guide,
+	float const spatial_sigma,
+	float const range_sigma
+){
+	size_t const height = guide.height();
+	size_t const width = guide.width();
+
+	for (auto const channel : channels){
+		if (channel->height() != height || channel->width() != width){
+			throw std::out_of_range("Channels to filter must be the same size as the guide.");
+		}
+	}
+
+	if (channels.empty() || guide.empty()) return;
+
+	// every cell holds the sum of each channel plus the amount of pixels splatted into it,
+	// the padding keeps the 5 tap blur from needing bounds checks on the borders
+	size_t constexpr PAD = 2;
+	// cells are at least MIN_CELL pixels wide, so the grid stays a fraction of the image for any radius.
+	// Smaller sigmas are left to a blur of the grid narrower than a cell
+	float constexpr MIN_CELL = 8.0f;
+	float const spatial = std::max(spatial_sigma, 1.0f);
+	float const ss = std::max(spatial, MIN_CELL);
+	GridWeights const spatial_weights = spatial < MIN_CELL ? narrow_weights(spatial / ss) : BINOMIAL_WEIGHTS;
+	float const sr = std::max(range_sigma, 1.0f);
+	size_t const cell = channels.size() + 1;
+	size_t const gh = static_cast<size_t>((height - 1) / ss) + 1 + 2 * PAD;
+	size_t const gw = static_cast<size_t>((width - 1) / ss) + 1 + 2 * PAD;
+	size_t const gd = static_cast<size_t>(255 / sr) + 1 + 2 * PAD;
+	size_t const row_stride = gw * gd * cell;
+
+	Grid<float> cells(gh, row_stride, 0.0f);
+
+	//splat, each band of grid rows only gathers its own image rows so bands never collide.
+	// Row y goes to grid row y / ss + 0.5 + PAD, so only the rows around [start, end) are visited,
+	// with one more on each side in case float rounding moves them
+	parallel_bands(gh, 1, [&](size_t const start, size_t const end){
+		float const first = (static_cast<float>(start) - PAD - 0.5f) * ss;
+		float const last = (static_cast<float>(end) - PAD + 0.5f) * ss;
+		size_t const y_start = static_cast<size_t>(std::clamp(std::floor(first) - 1, 0.0f, static_cast<float>(height)));
+		size_t const y_end = static_cast<size_t>(std::clamp(std::ceil(last) + 1, 0.0f, static_cast<float>(height)));
+
+		for (size_t y = y_start; y < y_end; y++){
+			size_t const gy = static_cast<size_t>(y / ss + 0.5f) + PAD;
+			if (gy < start || gy >= end) continue;
+
+			float* __restrict row = cells[gy];
+			const int* __restrict gd_row = guide[y];
+
+			for (size_t x = 0; x < width; x++){
+				size_t const gx = static_cast<size_t>(x / ss + 0.5f) + PAD;
+				size_t const gz = static_cast<size_t>(std::clamp(gd_row[x], 0, 255) / sr + 0.5f) + PAD;
+				float* __restrict target = row + (gx * gd + gz) * cell;
+
+				for (size_t c = 0; c < cell - 1; c++){
+					target[c] += (*channels[c])[y][x];
+				}
+				target[cell - 1] += 1.0f;
+			}
+		}
+	});
+
+	//blur along depth, columns and rows of the grid
+	blur_grid_lines(cells.raw(), gh * gw, gd * cell, gd, cell, cell, BINOMIAL_WEIGHTS);
+	blur_grid_lines(cells.raw(), gh, row_stride, gw, gd * cell, gd * cell, spatial_weights);
+	blur_grid_lines(cells.raw(), gw, gd * cell, gh, row_stride, gd * cell, spatial_weights);
+
+	//slice with trilinear interpolation
+	std::vector<size_t> column_index(width);
+	std::vector<float> column_weight(width);
+
+	for (size_t x = 0; x < width; x++){
+		float const fx = x / ss + PAD;
+		column_index[x] = static_cast<size_t>(fx);
+		column_weight[x] = fx - column_index[x];
+	}
+
+	std::vector<Grid<int>> results(channels.size(), Grid<int>(height, width));
+
+	parallel_bands(height, 64, [&](size_t const start, size_t const end){
+		std::vector<float> value(cell);
+
+		for (size_t y = start; y < end; y++){
+			float const fy = y / ss + PAD;
+			size_t const iy = static_cast<size_t>(fy);
+			float const wy = fy - iy;
+			const int* __restrict gd_row = guide[y];
+
+			for (size_t x = 0; x < width; x++){
+				float const fz = std::clamp(gd_row[x], 0, 255) / sr + PAD;
+				size_t const iz = static_cast<size_t>(fz);
+				float const wz = fz - iz;
+				size_t const ix = column_index[x];
+				float const wx = column_weight[x];
+
+				std::fill(value.begin(), value.end(), 0.0f);
+
+				for (size_t dy = 0; dy < 2; dy++){
+					float const* const row = cells[iy + dy];
+					float const fwy = dy ? wy : 1 - wy;
+
+					for (size_t dx = 0; dx < 2; dx++){
+						float const fwxy = fwy * (dx ? wx : 1 - wx);
+						float const* const column = row + (ix + dx) * gd * cell + iz * cell;
+
+						for (size_t dz = 0; dz < 2; dz++){
+							float const weight = fwxy * (dz ? wz : 1 - wz);
+							float const* const source = column + dz * cell;
+
+							for (size_t c = 0; c < cell; c++){
+								value[c] += source[c] * weight;
+							}
+						}
+					}
+				}
+
+				float const total = value[cell - 1];
+
+				for (size_t c = 0; c < cell - 1; c++){
+					results[c][y][x] = total > 0
+						? static_cast<int>(value[c] / total + 0.5f)
+						: (*channels[c])[y][x];
+				}
+			}
+		}
+	});
+
+	for (size_t c = 0; c < channels.size(); c++){
+		*channels[c] = std::move(results[c]);
+	}
+}
+
+
+// GUIDED FILTER
+
+Grid<float> box_mean(Grid<float> const &mat, size_t const radius){
+	size_t const height = mat.height();
+	size_t const width = mat.width();
+
+	Grid<float> rows(height, width);
+	Grid<float> out(height, width);
+
+	if (out.empty()) return out;
+
+	std::vector<float> column_inverse(width);
+	for (size_t x = 0; x < width; x++){
+		size_t const count = std::min(x + radius, width - 1) - (x > radius ? x - radius : 0) + 1;
+		column_inverse[x] = 1.0f / count;
+	}
+
+	//horizontal running sums
+	parallel_bands(height, 64, [&](size_t const start, size_t const end){
+		for (size_t y = start; y < end; y++){
+			const float* __restrict src = mat[y];
+			float* __restrict dst = rows[y];
+			double sum = 0;
+
+			for (size_t x = 0; x < std::min(radius, width); x++){
+				sum += src[x];
+			}
+
+			for (size_t x = 0; x < width; x++){
+				if (x + radius < width) sum += src[x + radius];
+				dst[x] = sum;
+				if (x >= radius) sum -= src[x - radius];
+			}
+		}
+	});
+
+	//vertical running sums, a band is never shorter than the window so starting the
+	//sums of each band costs at most one extra addition per pixel whatever the radius
+	parallel_bands(height, std::max<size_t>(64, 2 * radius + 1), [&](size_t const start, size_t const end){
+		std::vector<double> sum(width, 0.0);
+		double* __restrict sd = sum.data();
+
+		for (size_t y = (start > radius ? start - radius : 0); y < std::min(start + radius, height); y++){
+			const float* __restrict src = rows[y];
+			for (size_t x = 0; x < width; x++){
+				sd[x] += src[x];
+			}
+		}
+
+		for (size_t y = start; y < end; y++){
+			if (y + radius < height){
+				const float* __restrict add = rows[y + radius];
+				for (size_t x = 0; x < width; x++){
+					sd[x] += add[x];
+				}
+			}
+
+			size_t const count = std::min(y + radius, height - 1) - (y > radius ? y - radius : 0) + 1;
+			float const row_inverse = 1.0f / count;
+			float* __restrict dst = out[y];
+
+			for (size_t x = 0; x < width; x++){
+				dst[x] = sd[x] * column_inverse[x] * row_inverse;
+			}
+
+			if (y >= radius){
+				const float* __restrict remove = rows[y - radius];
+				for (size_t x = 0; x < width; x++){
+					sd[x] -= remove[x];
+				}
+			}
+		}
+	});
+
+	return out;
+}
+
+void guided_filter(
+	std::vector<Grid<int> *> const &channels,
+	Grid<int> const &guide,
+	size_t const radius,
+	float const epsilon
+){
+	size_t const height = guide.height();
+	size_t const width = guide.width();
+
+	for (auto const channel : channels){
+		if (channel->height() != height || channel->width() != width){
+			throw std::out_of_range("Channels to filter must be the same size as the guide.");
+		}
+	}
+
+	if (channels.empty() || guide.empty()) return;
+
+	// the guide stays in 0-255, so epsilon is scaled to match
+	float const eps = epsilon * 255.0f * 255.0f;
+
+	Grid<float> const I(guide);
+	Grid<float> const mean_I = box_mean(I, radius);
+	Grid<float> var_I = box_mean(I * I, radius);
+	var_I -= mean_I * mean_I;
+
+	for (auto const channel : channels){
+		Grid<float> const p(*channel);
+		Grid<float> const mean_p = box_mean(p, radius);
+		Grid<float> a = box_mean(I * p, radius);
+		a -= mean_I * mean_p;
+		Grid<float> b(height, width);
+
+		float* __restrict ad = a.raw();
+		float* __restrict bd = b.raw();
+		const float* __restrict vd = var_I.raw();
+		const float* __restrict mid = mean_I.raw();
+		const float* __restrict mpd = mean_p.raw();
+
+		for (size_t i = 0; i < a.size(); i++){
+			ad[i] /= vd[i] + eps;
+			bd[i] = mpd[i] - ad[i] * mid[i];
+		}
+
+		Grid<float> const mean_a = box_mean(a, radius);
+		Grid<float> const mean_b = box_mean(b, radius);
+
+		const float* __restrict mad = mean_a.raw();
+		const float* __restrict mbd = mean_b.raw();
+		const float* __restrict id = I.raw();
+		int* __restrict od = channel->raw();
+
+		for (size_t i = 0; i < channel->size(); i++){
+			od[i] = std::clamp(static_cast<int>(std::lround(mad[i] * id[i] + mbd[i])), 0, 255);
+		}
+	}
+}
+
+
+// MEDIAN FILTER
+
+// Constant time median of Perreault and Hébert, every column keeps a histogram of the
+// 2r+1 rows around the current one split in 16 coarse and 256 fine bins. The kernel
+// histogram slides by adding and removing whole column histograms, and the fine bins
+// of the kernel are only brought up to date for the coarse bin holding the median.
+static void median_band(
+	Grid<int> const &src,
+	Grid<int> &out,
+	size_t const radius,
+	size_t const start,
+	size_t const end
+){
+	long const height = src.height();
+	long const width = src.width();
+	long const r = radius;
+	uint32_t const rank = (2 * r + 1) * (2 * r + 1) / 2;
+
+	std::vector<uint16_t> coarse(width * 16, 0);
+	std::vector<uint16_t> fine(width * 256, 0);
+
+	auto clamp_row = [&](long const y){ return static_cast<size_t>(std::clamp<long>(y, 0, height - 1)); };
+	auto clamp_column = [&](long const x){ return static_cast<size_t>(std::clamp<long>(x, 0, width - 1)); };
+
+	auto update_row = [&](size_t const y, int const delta){
+		const int* __restrict row = src[y];
+		for (long x = 0; x < width; x++){
+			int const value = std::clamp(row[x], 0, 255);
+			coarse[x * 16 + (value >> 4)] += delta;
+			fine[x * 256 + value] += delta;
+		}
+	};
+
+	for (long k = -r; k <= r; k++){
+		update_row(clamp_row(start + k), 1);
+	}
+
+	uint32_t kernel_coarse[16];
+	uint32_t kernel_fine[256];
+	long last[16];
+
+	for (size_t y = start; y < end; y++){
+		if (y > start){
+			update_row(clamp_row(static_cast<long>(y) - r - 1), -1);
+			update_row(clamp_row(static_cast<long>(y) + r), 1);
+		}
+
+		std::fill_n(kernel_coarse, 16, 0);
+		std::fill_n(last, 16, std::numeric_limits<long>::min());
+
+		for (long k = -r; k <= r; k++){
+			const uint16_t* column = coarse.data() + clamp_column(k) * 16;
+			for (size_t b = 0; b < 16; b++){
+				kernel_coarse[b] += column[b];
+			}
+		}
+
+		int* __restrict od = out[y];
+
+		for (long x = 0; x < width; x++){
+			if (x > 0){
+				const uint16_t* added = coarse.data() + clamp_column(x + r) * 16;
+				const uint16_t* removed = coarse.data() + clamp_column(x - r - 1) * 16;
+				for (size_t b = 0; b < 16; b++){
+					kernel_coarse[b] += added[b] - removed[b];
+				}
+			}
+
+			uint32_t sum = 0;
+			size_t b = 0;
+			while (sum + kernel_coarse[b] <= rank){
+				sum += kernel_coarse[b];
+				b++;
+			}
+
+			uint32_t* const bins = kernel_fine + b * 16;
+
+			if (last[b] == std::numeric_limits<long>::min() || x - last[b] > 2 * r + 1){
+				std::fill_n(bins, 16, 0);
+				for (long k = x - r; k <= x + r; k++){
+					const uint16_t* column = fine.data() + clamp_column(k) * 256 + b * 16;
+					for (size_t v = 0; v < 16; v++){
+						bins[v] += column[v];
+					}
+				}
+			} else {
+				for (long k = last[b] + 1; k <= x; k++){
+					const uint16_t* added = fine.data() + clamp_column(k + r) * 256 + b * 16;
+					const uint16_t* removed = fine.data() + clamp_column(k - r - 1) * 256 + b * 16;
+					for (size_t v = 0; v < 16; v++){
+						bins[v] += added[v] - removed[v];
+					}
+				}
+			}
+
+			last[b] = x;
+
+			size_t v = 0;
+			while (sum + bins[v] <= rank){
+				sum += bins[v];
+				v++;
+			}
+
+			od[x] = b * 16 + v;
+		}
+	}
+}
+
+void median_filter(
+	std::vector<Grid<int> *> const &channels,
+	size_t const radius
+){
+	if (radius == 0) return;
+
+	for (auto const channel : channels){
+		Grid<int> out(channel->height(), channel->width());
+
+		// a band is never shorter than the window so filling the column histograms
+		// at its start costs at most one extra update per pixel whatever the radius
+		parallel_bands(channel->height(), std::max<size_t>(64, 2 * radius + 1), [&](size_t const start, size_t const end){
+			median_band(*channel, out, radius, start, end);
+		});
+
+		*channel = std::move(out);
+	}
+}
+
+
+// ANTIALIASING
+
+// FXAA style antialiasing over the luminance of the processed image. Pixels whose
+// neighbourhood contrast is low are copied, the rest find the direction of the edge
+// they sit on, follow it up to `steps` pixels each way to see how far they are from
+// its ends and blend with the neighbour across the edge accordingly.
+void antialias(
+	Grid<int> * const red,
+	Grid<int> * const green,
+	Grid<int> * const blue,
+	size_t const steps
+){
+	float constexpr EDGE_THRESHOLD = 0.125f;
+	float constexpr EDGE_THRESHOLD_MIN = 8.0f;
+	float constexpr SUBPIXEL_QUALITY = 0.75f;
+
+	long const height = red->height();
+	long const width = red->width();
+
+	if (red->empty()) return;
+
+	Grid<int> * const planes[3] = {red, green, blue};
+	Grid<int> out[3] = {
+		Grid<int>(height, width),
+		Grid<int>(height, width),
+		Grid<int>(height, width)
+	};
+
+	// edges are followed up to `steps` rows away, past the band a pixel is in, so the
+	// luminance of the whole image is computed before any band is processed
+	Grid<float> luma(height, width);
+
+	parallel_bands(height, 64, [&](size_t const start, size_t const end){
+		for (size_t y = start; y < end; y++){
+			const int* __restrict r = (*red)[y];
+			const int* __restrict g = (*green)[y];
+			const int* __restrict b = (*blue)[y];
+			float* __restrict ld = luma[y];
+
+			for (long x = 0; x < width; x++){
+				ld[x] = (r[x] + g[x] + b[x]) / 3.0f;
+			}
+		}
+	});
+
+	auto L = [&](long const y, long const x){
+		return luma[std::clamp<long>(y, 0, height - 1)][std::clamp<long>(x, 0, width - 1)];
+	};
+
+	parallel_bands(height, 64, [&](size_t const start, size_t const end){
+		for (long y = start; y < static_cast<long>(end); y++){
+			for (long x = 0; x < width; x++){
+				float const m = L(y, x);
+				float const n = L(y - 1, x);
+				float const s = L(y + 1, x);
+				float const w = L(y, x - 1);
+				float const e = L(y, x + 1);
+
+				float const lmax = std::max({m, n, s, w, e});
+				float const lmin = std::min({m, n, s, w, e});
+				float const range = lmax - lmin;
+
+				if (range < std::max(EDGE_THRESHOLD_MIN, lmax * EDGE_THRESHOLD)){
+					for (size_t c = 0; c < 3; c++){
+						out[c][y][x] = (*planes[c])[y][x];
+					}
+					continue;
+				}
+
+				float const nw = L(y - 1, x - 1);
+				float const ne = L(y - 1, x + 1);
+				float const sw = L(y + 1, x - 1);
+				float const se = L(y + 1, x + 1);
+
+				float const edge_horizontal =
+					std::fabs(nw + sw - 2 * w) + 2 * std::fabs(n + s - 2 * m) + std::fabs(ne + se - 2 * e);
+				float const edge_vertical =
+					std::fabs(nw + ne - 2 * n) + 2 * std::fabs(w + e - 2 * m) + std::fabs(sw + se - 2 * s);
+				bool const horizontal = edge_horizontal >= edge_vertical;
+
+				// the neighbour across the edge is on the side with the steepest gradient
+				float const l1 = horizontal ? n : w;
+				float const l2 = horizontal ? s : e;
+				bool const negative = std::fabs(l1 - m) >= std::fabs(l2 - m);
+				float const across = negative ? l1 : l2;
+				float const gradient = std::fabs(across - m) / 4;
+				float const local = (m + across) / 2;
+
+				long const dy = horizontal ? (negative ? -1 : 1) : 0;
+				long const dx = horizontal ? 0 : (negative ? -1 : 1);
+				long const sy = horizontal ? 0 : 1;
+				long const sx = horizontal ? 1 : 0;
+
+				// walk along the edge until the luminance between both sides changes
+				auto walk = [&](long const direction){
+					size_t distance = 1;
+					for (; distance <= steps; distance++){
+						long const py = y + direction * sy * distance;
+						long const px = x + direction * sx * distance;
+						float const ends = (L(py, px) + L(py + dy, px + dx)) / 2;
+						if (std::fabs(ends - local) >= gradient) break;
+					}
+					return distance;
+				};
+
+				float const backward = walk(-1);
+				float const forward = walk(1);
+				float const edge_blend = 0.5f - std::min(backward, forward) / (backward + forward);
+
+				float const average = (2 * (n + s + w + e) + nw + ne + sw + se) / 12;
+				float const subpixel = std::clamp(std::fabs(average - m) / range, 0.0f, 1.0f);
+				float const smooth = (-2 * subpixel + 3) * subpixel * subpixel;
+				float const subpixel_blend = smooth * smooth * SUBPIXEL_QUALITY;
+
+				float const blend = std::max(edge_blend, subpixel_blend);
+				size_t const ny = std::clamp<long>(y + dy, 0, height - 1);
+				size_t const nx = std::clamp<long>(x + dx, 0, width - 1);
+
+				for (size_t c = 0; c < 3; c++){
+					float const value = (*planes[c])[y][x] * (1 - blend) + (*planes[c])[ny][nx] * blend;
+					out[c][y][x] = static_cast<int>(value + 0.5f);
+				}
+			}
+		}
+	});
+
+	for (size_t c = 0; c < 3; c++){
+		*planes[c] = std::move(out[c]);
+	}
+}
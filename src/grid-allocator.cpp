@@ -0,0 +1,102 @@
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <unordered_set>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "grid-allocator.h"
+
+static std::atomic<size_t> memory_limit(0);
+static std::atomic<size_t> heap_in_use(0);
+
+// the mapped blocks, freeing has to know where a block came from. Until something is mapped
+// the count stays 0 and freeing never takes the lock
+static std::mutex mapped_lock;
+static std::unordered_set<void *> mapped;
+static std::atomic<size_t> mapped_count(0);
+
+void set_grid_memory_limit(size_t const bytes){
+	memory_limit = bytes;
+}
+
+// Shared mapping of a temporary file that is unlinked right away, so it is gone with the process
+static void * map_temporary(size_t const bytes){
+	char const * const directory = getenv("TMPDIR");
+	std::string path = std::string(directory && directory[0] ? directory : "/tmp") + "/kquantizer-XXXXXX";
+	std::vector<char> name(path.begin(), path.end());
+	name.push_back('\0');
+
+	int const file = mkstemp(name.data());
+	if (file == -1) return nullptr;
+	unlink(name.data());
+
+	void * pointer = nullptr;
+	if (ftruncate(file, static_cast<off_t>(bytes)) == 0){
+		pointer = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		if (pointer == MAP_FAILED) pointer = nullptr;
+	}
+
+	close(file);
+	return pointer;
+}
+
+// Takes bytes of the heap budget, false when they do not fit under the limit. The check and the
+// update are one step, so bands allocating at the same time can not go past it together
+static bool reserve_heap(size_t const bytes){
+	size_t const limit = memory_limit;
+	if (limit == 0){
+		heap_in_use += bytes;
+		return true;
+	}
+
+	size_t used = heap_in_use.load(std::memory_order_relaxed);
+	do {
+		if (used + bytes > limit) return false;
+	} while (!heap_in_use.compare_exchange_weak(used, used + bytes));
+
+	return true;
+}
+
+void * grid_allocate(size_t const bytes){
+	if (bytes == 0) return ::operator new(0);
+
+	if (reserve_heap(bytes)){
+		try {
+			return ::operator new(bytes);
+		} catch (...) {
+			heap_in_use -= bytes;
+			throw;
+		}
+	}
+
+	void * const pointer = map_temporary(bytes);
+	if (!pointer) throw std::bad_alloc();
+
+	std::lock_guard<std::mutex> lock(mapped_lock);
+	mapped.insert(pointer);
+	mapped_count++;
+	return pointer;
+}
+
+void grid_deallocate(void * const pointer, size_t const bytes){
+	if (bytes > 0){
+		// a mapped block was counted before it was handed out, so a free of it always sees the count
+		if (mapped_count > 0){
+			std::unique_lock<std::mutex> lock(mapped_lock);
+			if (mapped.erase(pointer)){
+				mapped_count--;
+				lock.unlock();
+				munmap(pointer, bytes);
+				return;
+			}
+		}
+		heap_in_use -= bytes;
+	}
+
+	::operator delete(pointer);
+}
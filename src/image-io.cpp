@@ -0,0 +1,42 @@
+#include <climits>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stb_image.h"
+#include "image-io.h"
+
+unsigned char * load_image(
+	std::filesystem::path const &path,
+	int * width,
+	int * height,
+	int * channels
+){
+	int const file = open(path.c_str(), O_RDONLY);
+	if (file == -1) return stbi_load(path.c_str(), width, height, channels, 0);
+
+	struct stat info;
+	if (fstat(file, &info) == -1 || info.st_size <= 0 || info.st_size > INT_MAX) { // stb takes the length as an int
+		close(file);
+		return stbi_load(path.c_str(), width, height, channels, 0);
+	}
+
+	size_t const size = static_cast<size_t>(info.st_size);
+	void * const mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+
+	if (mapping == MAP_FAILED) return stbi_load(path.c_str(), width, height, channels, 0);
+
+	// the decoder goes through the file once from the start
+	madvise(mapping, size, MADV_SEQUENTIAL);
+
+	unsigned char * const pixels = stbi_load_from_memory(
+		static_cast<unsigned char const *>(mapping), static_cast<int>(size),
+		width, height, channels, 0);
+
+	munmap(mapping, size);
+	return pixels;
+}
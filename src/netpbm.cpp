@@ -0,0 +1,150 @@
+#include <iostream>
+#include <string>
+#include <cctype>
+#include <cstdio>
+#include <filesystem>
+
+#include "netpbm.h"
+
+bool is_netpbm(std::filesystem::path const &path){
+	std::filesystem::path const extension = path.extension();
+	return extension == ".ppm" || extension == ".pam";
+}
+
+
+// HEADER PARSING
+
+// Next whitespace separated token, comments run from '#' to the end of the line
+static std::string next_token(FILE * file){
+	std::string token;
+	int c = fgetc(file);
+
+	while (c != EOF){
+		if (c == '#'){
+			while (c != EOF && c != '\n') c = fgetc(file);
+		} else if (isspace(c)){
+			if (!token.empty()) break;
+		} else {
+			token.push_back(static_cast<char>(c));
+		}
+		c = fgetc(file);
+	}
+
+	// the whitespace after the last token of the header is the only one before the samples, so it is consumed
+	return token;
+}
+
+static bool to_size(std::string const &token, size_t &value){
+	if (token.empty() || token.find_first_not_of("0123456789") != std::string::npos) return false;
+	value = std::stoull(token);
+	return true;
+}
+
+
+bool read_netpbm_header(FILE * file, RowLayout &layout){
+	std::string const magic = next_token(file);
+	size_t maxval = 0;
+
+	if (magic == "P6"){
+		if (!to_size(next_token(file), layout.width) || !to_size(next_token(file), layout.height) || !to_size(next_token(file), maxval)){
+			std::cerr << "Broken PPM header" << std::endl;
+			return false;
+		}
+		layout.channels = 3;
+	} else if (magic == "P7"){
+		std::string tuple_type;
+
+		for (std::string key = next_token(file); key != "ENDHDR"; key = next_token(file)){
+			if (key.empty()){
+				std::cerr << "Broken PAM header" << std::endl;
+				return false;
+			}
+
+			std::string const value = next_token(file);
+			bool valid = true;
+
+			if (key == "WIDTH") valid = to_size(value, layout.width);
+			else if (key == "HEIGHT") valid = to_size(value, layout.height);
+			else if (key == "DEPTH") valid = to_size(value, layout.channels);
+			else if (key == "MAXVAL") valid = to_size(value, maxval);
+			else if (key == "TUPLTYPE") tuple_type = value;
+
+			if (!valid){
+				std::cerr << "Broken PAM header" << std::endl;
+				return false;
+			}
+		}
+
+		if (layout.channels != 3 && layout.channels != 4){
+			std::cerr << "PAM image is neither RGB nor RGBA" << std::endl;
+			return false;
+		}
+	} else {
+		std::cerr << "Only binary PPM and PAM files can be streamed" << std::endl;
+		return false;
+	}
+
+	if (maxval != 255){
+		std::cerr << "Only 8 bit samples can be streamed" << std::endl;
+		return false;
+	}
+
+	layout.pixel_bytes = layout.channels;
+	layout.stride = layout.width * layout.channels;
+	layout.data_start = ftello(file);
+	return true;
+}
+
+
+NetpbmWriter::~NetpbmWriter(){
+	close();
+}
+
+bool NetpbmWriter::open(std::filesystem::path const &path, size_t const height, size_t const width, size_t const channels){
+	bool const pam = path.extension() == ".pam";
+
+	if (!is_netpbm(path)){
+		std::cerr << "Only .ppm and .pam images can be written a band at a time: " << path << std::endl;
+		return false;
+	}
+
+	if (!pam && channels != 3){
+		std::cerr << "PPM can only hold RGB, use .pam for RGBA" << std::endl;
+		return false;
+	}
+
+	m_file = fopen(path.c_str(), "wb");
+	if (!m_file){
+		std::cerr << "Could not open " << path << std::endl;
+		return false;
+	}
+
+	m_width = width;
+	m_channels = channels;
+
+	if (pam){
+		fprintf(m_file, "P7\nWIDTH %zu\nHEIGHT %zu\nDEPTH %zu\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+			width, height, channels, channels == 4 ? "RGB_ALPHA" : "RGB");
+	} else {
+		fprintf(m_file, "P6\n%zu %zu\n255\n", width, height);
+	}
+
+	return !ferror(m_file);
+}
+
+bool NetpbmWriter::write_rows(unsigned char const * in, size_t const rows){
+	size_t const size = rows * m_width * m_channels;
+	if (fwrite(in, 1, size, m_file) != size){
+		std::cerr << "Could not write the image" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool NetpbmWriter::close(){
+	if (!m_file) return true;
+
+	bool const failed = fclose(m_file) != 0;
+	m_file = nullptr;
+	return !failed;
+}
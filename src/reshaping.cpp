@@ -1,10 +1,140 @@
 #include <iostream>
 #include <vector>
 #include <array>
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
 
 #include "grid.h"
 #include "reshaping.h"
 
+// ROW KERNELS
+// the SIMD paths move 8 (AVX2) or 4 (SSSE3) pixels at a time and leave the rest of the row to the scalar loop,
+// RGB rows read and write a few bytes past the pixels they handle so they stop 4 bytes before the end of the row
+
+static void deinterleave_row(
+	unsigned char const * __restrict in,
+	int * const * planes,
+	size_t const width,
+	size_t const channels
+){
+	size_t j = 0;
+
+#if defined(__AVX2__)
+	if (channels >= 3) {
+		// every lane becomes R0-3 G0-3 B0-3 A0-3, then the permute joins the lanes channel by channel
+		__m256i const gather = channels == 4
+			? _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15, 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15)
+			: _mm256_setr_epi8(0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1, 0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1);
+		__m256i const order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+		size_t const slack = channels == 3 ? 4 : 0;
+
+		for (; (j + 8) * channels + slack <= width * channels; j += 8) {
+			unsigned char const * p = in + j * channels;
+			__m256i const pixels = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const *>(p))),
+				_mm_loadu_si128(reinterpret_cast<__m128i const *>(p + 4 * channels)), 1);
+			__m256i const planar = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(pixels, gather), order);
+			__m128i const low = _mm256_castsi256_si128(planar);
+			__m128i const high = _mm256_extracti128_si256(planar, 1);
+
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(planes[0] + j), _mm256_cvtepu8_epi32(low));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(planes[1] + j), _mm256_cvtepu8_epi32(_mm_srli_si128(low, 8)));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(planes[2] + j), _mm256_cvtepu8_epi32(high));
+			if (channels == 4) {
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(planes[3] + j), _mm256_cvtepu8_epi32(_mm_srli_si128(high, 8)));
+			}
+		}
+	}
+#elif defined(__SSSE3__)
+	if (channels >= 3) {
+		__m128i const gather = channels == 4
+			? _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15)
+			: _mm_setr_epi8(0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1);
+		__m128i const zero = _mm_setzero_si128();
+
+		for (; j * channels + 16 <= width * channels; j += 4) {
+			__m128i const planar = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(in + j * channels)), gather);
+			__m128i const rg = _mm_unpacklo_epi8(planar, zero);
+			__m128i const ba = _mm_unpackhi_epi8(planar, zero);
+
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(planes[0] + j), _mm_unpacklo_epi16(rg, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(planes[1] + j), _mm_unpackhi_epi16(rg, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(planes[2] + j), _mm_unpacklo_epi16(ba, zero));
+			if (channels == 4) {
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(planes[3] + j), _mm_unpackhi_epi16(ba, zero));
+			}
+		}
+	}
+#endif
+
+	for (; j < width; j++) {
+		for (size_t c = 0; c < channels; c++) {
+			planes[c][j] = in[j * channels + c];
+		}
+	}
+}
+
+// Values outside of 0 - 255 saturate instead of wrapping around
+static void interleave_row(
+	int const * const * planes,
+	unsigned char * __restrict out,
+	size_t const width,
+	size_t const channels
+){
+	size_t j = 0;
+
+#if defined(__AVX2__)
+	if (channels >= 3) {
+		// the packs keep the lanes apart, so every lane holds the bytes R0-3 G0-3 B0-3 A0-3 of its 4 pixels
+		__m256i const scatter = channels == 4
+			? _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15, 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15)
+			: _mm256_setr_epi8(0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, -1, -1, -1, -1, 0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, -1, -1, -1, -1);
+		size_t const slack = channels == 3 ? 4 : 0;
+
+		for (; (j + 8) * channels + slack <= width * channels; j += 8) {
+			__m256i const r = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(planes[0] + j));
+			__m256i const g = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(planes[1] + j));
+			__m256i const b = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(planes[2] + j));
+			__m256i const a = channels == 4 ? _mm256_loadu_si256(reinterpret_cast<__m256i const *>(planes[3] + j)) : _mm256_setzero_si256();
+
+			__m256i const bytes = _mm256_packus_epi16(_mm256_packs_epi32(r, g), _mm256_packs_epi32(b, a));
+			__m256i const pixels = _mm256_shuffle_epi8(bytes, scatter);
+
+			unsigned char * p = out + j * channels;
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(p), _mm256_castsi256_si128(pixels));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(p + 4 * channels), _mm256_extracti128_si256(pixels, 1));
+		}
+	}
+#elif defined(__SSSE3__)
+	if (channels >= 3) {
+		__m128i const scatter = channels == 4
+			? _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15)
+			: _mm_setr_epi8(0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, -1, -1, -1, -1);
+
+		for (; j * channels + 16 <= width * channels; j += 4) {
+			__m128i const r = _mm_loadu_si128(reinterpret_cast<__m128i const *>(planes[0] + j));
+			__m128i const g = _mm_loadu_si128(reinterpret_cast<__m128i const *>(planes[1] + j));
+			__m128i const b = _mm_loadu_si128(reinterpret_cast<__m128i const *>(planes[2] + j));
+			__m128i const a = channels == 4 ? _mm_loadu_si128(reinterpret_cast<__m128i const *>(planes[3] + j)) : _mm_setzero_si128();
+
+			__m128i const bytes = _mm_packus_epi16(_mm_packs_epi32(r, g), _mm_packs_epi32(b, a));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out + j * channels), _mm_shuffle_epi8(bytes, scatter));
+		}
+	}
+#endif
+
+	for (; j < width; j++) {
+		for (size_t c = 0; c < channels; c++) {
+			out[j * channels + c] = static_cast<unsigned char>(std::clamp(planes[c][j], 0, 255));
+		}
+	}
+}
+
+
 bool vectorize_to_rgb(
 	unsigned char const * data, size_t const height, size_t const width,
 	Grid<int> * red,
@@ -24,13 +154,15 @@ bool vectorize_to_rgb(
 		grids[c]->reshape_raw(height, width);
 	}
 
-	for (size_t i = 0; i < height; i++){
-		for (size_t j = 0; j < width; j++){
+	parallel_bands(height, 16, [&](size_t const start, size_t const end) {
+		for (size_t i = start; i < end; i++){
+			int * planes[4];
 			for (size_t c = 0; c < channels; c++){
-				(*(grids[c]))[i][j] = data[(i * width + j) * channels + c];
+				planes[c] = (*grids[c])[i];
 			}
+			deinterleave_row(data + i * width * channels, planes, width, channels);
 		}
-	}
+	});
 
 	return true;
 }
@@ -58,14 +190,14 @@ std::vector<std::array<int, 3>> vectorize_to_color_list(unsigned char const * da
 }
 
 
-std::vector<unsigned char> flatten(
+template <typename O>
+static bool flatten_rows(
+	O * out,
 	Grid<int> const * red,
 	Grid<int> const * green,
 	Grid<int> const * blue,
 	Grid<int> const * alpha
 ){
-    // the output array must be deleted afterward
-    
     size_t channels;
     Grid<int> const * const grids[4] = {red, green, blue, alpha};
 
@@ -82,19 +214,68 @@ std::vector<unsigned char> flatten(
     for (size_t c = 0; c < channels; c++){
     	if (red->height() != grids[c]->height() || red->width() != grids[c]->width()){
     		std::cerr << "Grids to flatten have different sizes." << std::endl;
-    		return {};
+    		return false;
     	}
     }
 
-    std::vector<unsigned char> out(red->height() * red->width() * channels);
+    size_t const width = red->width();
+    size_t const stride = width * channels;
+
+	parallel_bands(red->height(), 16, [&](size_t const start, size_t const end) {
+		std::vector<unsigned char> row(std::is_same_v<O, unsigned char> ? 0 : stride);
 
-    for (size_t i = 0; i < red->height(); i++){
-		for (size_t j = 0; j < red->width(); j++){
+		for (size_t i = start; i < end; i++){
+			int const * planes[4];
 			for (size_t c = 0; c < channels; c++){
-				out[(i * red->width() + j) * channels + c] = (*(grids[c]))[i][j];
+				planes[c] = (*grids[c])[i];
+			}
+
+			if constexpr (std::is_same_v<O, unsigned char>) {
+				interleave_row(planes, out + i * stride, width, channels);
+			} else {
+				interleave_row(planes, row.data(), width, channels);
+				for (size_t j = 0; j < stride; j++){
+					out[i * stride + j] = static_cast<O>(row[j]) / 255;
+				}
 			}
 		}
-	}
+	});
     
-    return out;
+    return true;
+}
+
+
+bool flatten_into(
+	unsigned char * out,
+	Grid<int> const * red,
+	Grid<int> const * green,
+	Grid<int> const * blue,
+	Grid<int> const * alpha
+){
+	return flatten_rows(out, red, green, blue, alpha);
+}
+
+
+bool flatten_into(
+	float * out,
+	Grid<int> const * red,
+	Grid<int> const * green,
+	Grid<int> const * blue,
+	Grid<int> const * alpha
+){
+	return flatten_rows(out, red, green, blue, alpha);
+}
+
+
+std::vector<unsigned char> flatten(
+	Grid<int> const * red,
+	Grid<int> const * green,
+	Grid<int> const * blue,
+	Grid<int> const * alpha
+){
+	size_t const channels = green == nullptr ? 1 : blue == nullptr ? 2 : alpha == nullptr ? 3 : 4;
+	std::vector<unsigned char> out(red->size() * channels);
+
+	if (!flatten_into(out.data(), red, green, blue, alpha)) return {};
+	return out;
 }
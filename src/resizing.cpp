@@ -0,0 +1,109 @@
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "resizing.h"
+#include "parallel.h"
+
+// Source pixels and weights that make up every output pixel along one axis,
+// output i reads `count` pixels from start[i] on with weights[i * count + k]
+struct Taps {
+	size_t count;
+	std::vector<size_t> start;
+	std::vector<float> weights;
+};
+
+static Taps make_taps(size_t const old_size, size_t const new_size){
+	Taps taps;
+	double const scale = static_cast<double>(old_size) / new_size;
+
+	if (scale >= 1){
+		// area average, output i covers [i * scale, (i + 1) * scale)
+		taps.count = std::min(static_cast<size_t>(std::ceil(scale)) + 1, old_size);
+		taps.start.resize(new_size);
+		taps.weights.assign(new_size * taps.count, 0.0f);
+
+		for (size_t i = 0; i < new_size; i++){
+			double const begin = i * scale;
+			double const end = std::min((i + 1) * scale, static_cast<double>(old_size));
+			taps.start[i] = std::min(static_cast<size_t>(begin), old_size - taps.count);
+
+			for (size_t k = 0; k < taps.count; k++){
+				double const source = taps.start[i] + k;
+				double const overlap = std::min(end, source + 1) - std::max(begin, source);
+				taps.weights[i * taps.count + k] = std::max(overlap, 0.0) / (end - begin);
+			}
+		}
+	} else {
+		// bilinear, pixel centers of both sizes line up
+		taps.count = 2;
+		taps.start.resize(new_size);
+		taps.weights.resize(new_size * 2);
+
+		for (size_t i = 0; i < new_size; i++){
+			double const position = std::clamp((i + 0.5) * scale - 0.5, 0.0, static_cast<double>(old_size - 1));
+			size_t const first = std::min(static_cast<size_t>(position), old_size > 1 ? old_size - 2 : 0);
+			float const weight = old_size > 1 ? position - first : 0.0f;
+
+			taps.start[i] = first;
+			taps.weights[i * 2] = 1 - weight;
+			taps.weights[i * 2 + 1] = weight;
+		}
+	}
+
+	return taps;
+}
+
+std::vector<unsigned char> resize_image(
+	unsigned char const * data,
+	size_t const old_height,
+	size_t const old_width,
+	size_t const new_height,
+	size_t const new_width,
+	size_t const channels
+){
+	std::vector<unsigned char> output(new_height * new_width * channels);
+	if (output.empty() || old_height == 0 || old_width == 0) return output;
+
+	Taps const rows = make_taps(old_height, new_height);
+	Taps const columns = make_taps(old_width, new_width);
+	size_t const old_stride = old_width * channels;
+
+	parallel_bands(new_height, 16, [&](size_t const start, size_t const end){
+		std::vector<float> line(old_stride);
+		float* __restrict ld = line.data();
+
+		for (size_t y = start; y < end; y++){
+			//vertical pass into one full width row
+			std::fill_n(ld, old_stride, 0.0f);
+
+			for (size_t k = 0; k < rows.count; k++){
+				float const weight = rows.weights[y * rows.count + k];
+				if (weight == 0.0f) continue;
+
+				const unsigned char* __restrict src = data + (rows.start[y] + k) * old_stride;
+				for (size_t i = 0; i < old_stride; i++){
+					ld[i] += src[i] * weight;
+				}
+			}
+
+			//horizontal pass
+			unsigned char* __restrict od = output.data() + y * new_width * channels;
+
+			for (size_t x = 0; x < new_width; x++){
+				const float* __restrict src = ld + columns.start[x] * channels;
+				const float* __restrict weights = columns.weights.data() + x * columns.count;
+
+				for (size_t c = 0; c < channels; c++){
+					float sum = 0.5f;
+					for (size_t k = 0; k < columns.count; k++){
+						sum += src[k * channels + c] * weights[k];
+					}
+					od[x * channels + c] = static_cast<unsigned char>(std::clamp(sum, 0.0f, 255.0f));
+				}
+			}
+		}
+	});
+
+	return output;
+}
@@ -0,0 +1,240 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <iostream>
+#include <filesystem>
+
+#include "netpbm.h"
+#include "row-reader.h"
+
+bool is_streamable(std::filesystem::path const &path){
+	std::filesystem::path const extension = path.extension();
+	return is_netpbm(path) || extension == ".bmp" || extension == ".dib" || extension == ".tga";
+}
+
+static uint32_t little_endian(unsigned char const * bytes, size_t const size){
+	uint32_t value = 0;
+	for (size_t i = 0; i < size; i++){
+		value |= static_cast<uint32_t>(bytes[i]) << (8 * i);
+	}
+	return value;
+}
+
+
+// HEADER PARSING
+
+// BMP files start with a 14 byte file header and an info header of one of five sizes,
+// V4 and V5 headers hold the channel masks in the same place as the BITFIELDS after an info header
+static bool read_bmp_header(FILE * file, RowLayout &layout){
+	unsigned char header[14 + 124 + 12] = {};
+	size_t const read = fread(header, 1, sizeof(header), file);
+
+	uint32_t const info_size = little_endian(header + 14, 4);
+	if (read < 26 || header[0] != 'B' || header[1] != 'M' || read < 14 + info_size){
+		std::cerr << "Broken BMP header" << std::endl;
+		return false;
+	}
+
+	int64_t width, height;
+	uint32_t planes, bits, compression = 0;
+
+	if (info_size == 12){
+		width = little_endian(header + 18, 2);
+		height = little_endian(header + 20, 2);
+		planes = little_endian(header + 22, 2);
+		bits = little_endian(header + 24, 2);
+	} else if (info_size == 40 || info_size == 56 || info_size == 108 || info_size == 124){
+		width = static_cast<int32_t>(little_endian(header + 18, 4));
+		height = static_cast<int32_t>(little_endian(header + 22, 4));
+		planes = little_endian(header + 26, 2);
+		bits = little_endian(header + 28, 2);
+		compression = little_endian(header + 30, 4);
+	} else {
+		std::cerr << "Unknown BMP header" << std::endl;
+		return false;
+	}
+
+	// rows are stored bottom up unless the height is negative, a width below 1 is an empty image
+	layout.width = static_cast<size_t>(width > 0 ? width : 0);
+	layout.bottom_up = height > 0;
+	layout.height = static_cast<size_t>(height < 0 ? -height : height);
+	layout.data_start = little_endian(header + 10, 4);
+	layout.bgr = true;
+
+	// BI_BITFIELDS, only the byte aligned masks stb_image_write and most programs use
+	bool const fields = compression == 3 && bits == 32 && info_size != 56
+		&& read >= 14 + 40 + 12
+		&& little_endian(header + 54, 4) == 0xff0000
+		&& little_endian(header + 58, 4) == 0xff00
+		&& little_endian(header + 62, 4) == 0xff;
+	uint32_t const alpha_mask = info_size >= 108 ? little_endian(header + 66, 4) : 0;
+
+	if (planes == 1 && compression == 0 && bits == 24){
+		layout.channels = 3;
+	} else if (planes == 1 && compression == 0 && bits == 32 && info_size != 12){
+		layout.channels = 4;
+		layout.opaque = true;
+	} else if (planes == 1 && fields && (alpha_mask == 0 || alpha_mask == 0xff000000)){
+		layout.channels = alpha_mask ? 4 : 3;
+	} else {
+		std::cerr << "Only uncompressed 24 and 32 bit BMP files can be streamed" << std::endl;
+		return false;
+	}
+
+	layout.pixel_bytes = bits / 8;
+	layout.stride = (layout.width * layout.pixel_bytes + 3) / 4 * 4;
+
+	// the fourth byte of BI_RGB pixels is alpha, unless it is 0 everywhere
+	if (layout.opaque){
+		if (fseeko(file, layout.data_start, SEEK_SET) != 0){
+			std::cerr << "Image ended before all of its rows" << std::endl;
+			return false;
+		}
+
+		std::vector<unsigned char> row(layout.stride);
+		for (size_t y = 0; y < layout.height && layout.opaque; y++){
+			if (fread(row.data(), 1, row.size(), file) != row.size()){
+				std::cerr << "Image ended before all of its rows" << std::endl;
+				return false;
+			}
+			for (size_t x = 0; x < layout.width; x++){
+				if (row[x * 4 + 3] != 0){
+					layout.opaque = false;
+					break;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+// TGA files have an 18 byte header and an image ID after it, and no magic number
+static bool read_tga_header(FILE * file, RowLayout &layout){
+	unsigned char header[18];
+	if (fread(header, 1, sizeof(header), file) != sizeof(header)){
+		std::cerr << "Broken TGA header" << std::endl;
+		return false;
+	}
+
+	unsigned const bits = header[16];
+
+	// type 2 is uncompressed true color without a color map
+	if (header[1] != 0 || header[2] != 2 || (bits != 24 && bits != 32)){
+		std::cerr << "Only uncompressed 24 and 32 bit TGA files can be streamed" << std::endl;
+		return false;
+	}
+
+	layout.width = little_endian(header + 12, 2);
+	layout.height = little_endian(header + 14, 2);
+	layout.channels = bits / 8;
+	layout.pixel_bytes = layout.channels;
+	layout.stride = layout.width * layout.pixel_bytes;
+	layout.data_start = sizeof(header) + header[0];
+	layout.bgr = true;
+
+	// rows are stored bottom up unless bit 5 of the descriptor is set
+	layout.bottom_up = (header[17] & 0x20) == 0;
+	return true;
+}
+
+
+// READING
+
+RowReader::~RowReader(){
+	if (m_file) fclose(m_file);
+}
+
+bool RowReader::open(std::filesystem::path const &path){
+	m_file = fopen(path.c_str(), "rb");
+	if (!m_file){
+		std::cerr << "Could not open " << path << std::endl;
+		return false;
+	}
+
+	std::filesystem::path const extension = path.extension();
+	bool read;
+
+	if (is_netpbm(path)){
+		read = read_netpbm_header(m_file, m_layout);
+	} else if (extension == ".bmp" || extension == ".dib"){
+		read = read_bmp_header(m_file, m_layout);
+	} else if (extension == ".tga"){
+		read = read_tga_header(m_file, m_layout);
+	} else {
+		std::cerr << "Only .ppm, .pam, .bmp and .tga images can be streamed: " << path << std::endl;
+		return false;
+	}
+
+	if (!read) return false;
+
+	if (m_layout.width == 0 || m_layout.height == 0){
+		std::cerr << "Image is empty" << std::endl;
+		return false;
+	}
+
+	m_row = 0;
+	return true;
+}
+
+bool RowReader::rewind(){
+	m_row = 0;
+	return m_file != nullptr;
+}
+
+bool RowReader::read_rows(unsigned char * out, size_t const rows){
+	RowLayout const &layout = m_layout;
+
+	if (m_row + rows > layout.height){
+		std::cerr << "Image ended before all of its rows" << std::endl;
+		return false;
+	}
+
+	// the rows of a band are next to each other in the file either way, bottom up they are in reverse
+	size_t const first = layout.bottom_up ? layout.height - m_row - rows : m_row;
+	size_t const size = rows * layout.stride;
+
+	bool const direct = !layout.bottom_up && !layout.bgr && layout.stride == layout.width * layout.channels;
+	if (!direct){
+		m_buffer.resize(size);
+	}
+
+	if (fseeko(m_file, layout.data_start + static_cast<off_t>(first * layout.stride), SEEK_SET) != 0
+		|| fread(direct ? out : m_buffer.data(), 1, size, m_file) != size
+	){
+		std::cerr << "Image ended before all of its rows" << std::endl;
+		return false;
+	}
+
+	if (!direct){
+		convert_rows(out, rows);
+	}
+
+	m_row += rows;
+	return true;
+}
+
+// Turns the rows in the buffer into tightly packed RGB or RGBA rows from the top down
+void RowReader::convert_rows(unsigned char * out, size_t const rows){
+	RowLayout const &layout = m_layout;
+	size_t const red = layout.bgr ? 2 : 0;
+	size_t const blue = layout.bgr ? 0 : 2;
+
+	for (size_t y = 0; y < rows; y++){
+		unsigned char const * in = m_buffer.data() + (layout.bottom_up ? rows - 1 - y : y) * layout.stride;
+		unsigned char * row = out + y * layout.width * layout.channels;
+
+		for (size_t x = 0; x < layout.width; x++){
+			unsigned char const * pixel = in + x * layout.pixel_bytes;
+			unsigned char * target = row + x * layout.channels;
+
+			target[0] = pixel[red];
+			target[1] = pixel[1];
+			target[2] = pixel[blue];
+			if (layout.channels == 4){
+				target[3] = layout.opaque ? 255 : pixel[3];
+			}
+		}
+	}
+}
@@ -0,0 +1,96 @@
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <utility>
+#include <algorithm>
+
+#include "check.h"
+#include "blur.h"
+#include "grid.h"
+
+// Big radii and sigmas are worked out on coarse pyramid levels, images with a side of a few pixels
+// build fewer levels than asked for and have to come out the same size, with the same strength
+
+std::string describe(size_t const height, size_t const width) {
+	return std::to_string(height) + "x" + std::to_string(width);
+}
+
+Grid<int> make_steps(size_t const height, size_t const width) {
+	Grid<int> mat(height, width);
+	for (size_t y = 0; y < height; y++) {
+		for (size_t x = 0; x < width; x++) {
+			mat[y][x] = ((x / 50 + y) % 2) ? 230 : 20;
+		}
+	}
+	return mat;
+}
+
+void check_tiny(size_t const height, size_t const width) {
+	Grid<int> const mat = make_steps(height, width);
+
+	for (float const sigma : {3.0f, 9.0f, 40.0f}) {
+		Grid<unsigned char> const outlines = detect_outlines(mat, sigma, 4);
+		check(outlines.height() == height && outlines.width() == width,
+			"outlines of " + describe(height, width) + " with sigma " + std::to_string(sigma));
+	}
+
+	for (size_t const radius : {10, 40, 100}) {
+		Grid<int> blurred = mat;
+		Grid<float> const mask(height, width, 0.5f);
+		blur_channels({&blurred}, radius, radius / 1.5f, &mask, 1);
+		check(blurred.height() == height && blurred.width() == width,
+			"blur of " + describe(height, width) + " with radius " + std::to_string(radius));
+	}
+}
+
+// A strip two rows high only reduces once, the blur of its coarse level has to be as wide as the
+// full one. Both are divided by their blur of a constant image, which takes out the dark borders
+void check_thin_strength() {
+	unsigned constexpr SHIFT = 10;
+	size_t constexpr RADIUS = 40;
+	float constexpr SIGMA = RADIUS / 1.5f;
+
+	// one step in the middle, the same on both rows
+	int constexpr HIGH = 2000;
+	Grid<int> steps(2, 600, 0);
+	Grid<int> const flat(2, 600, HIGH);
+	for (size_t y = 0; y < 2; y++) {
+		std::fill(steps[y] + 300, steps[y] + 600, HIGH);
+	}
+
+	auto coarse = [&](Grid<int> mat) {
+		blur_channels({&mat}, RADIUS, SIGMA);
+		return mat;
+	};
+
+	auto direct = [&](Grid<int> mat) {
+		convolve_channels<int>({&mat}, g_kernel_fixed(2 * RADIUS + 1, SIGMA, SHIFT), nullptr, 1, 2 * SHIFT);
+		return mat;
+	};
+
+	Grid<int> const coarse_steps = coarse(steps), coarse_flat = coarse(flat);
+	Grid<int> const direct_steps = direct(steps), direct_flat = direct(flat);
+
+	// share of the step reached around it, a blur half as wide would be off by over a tenth
+	double difference = 0;
+	for (size_t x = 300 - 2 * RADIUS; x < 300 + 2 * RADIUS; x++) {
+		double const expected = static_cast<double>(direct_steps[0][x]) / direct_flat[0][x];
+		double const found = static_cast<double>(coarse_steps[0][x]) / coarse_flat[0][x];
+		difference = std::max(difference, std::abs(found - expected));
+	}
+
+	check(difference <= 0.05, "pyramid blur of a thin strip is off by " + std::to_string(difference));
+}
+
+int main() {
+	for (auto const [height, width] : {
+		std::pair<size_t, size_t>{1, 1}, {1, 9}, {9, 1}, {2, 2}, {1, 300}, {8, 300}, {300, 8}
+	}) {
+		check_tiny(height, width);
+	}
+
+	check_thin_strength();
+
+	return failures;
+}
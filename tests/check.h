@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+#include <iostream>
+
+// Failed checks of the test, main returns it so ctest sees any of them
+inline int failures = 0;
+
+inline void check(bool const passed, std::string const &what) {
+	if (passed) return;
+
+	std::cerr << "FAILED: " << what << std::endl;
+	failures++;
+}
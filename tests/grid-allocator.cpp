@@ -0,0 +1,75 @@
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "check.h"
+#include "blur.h"
+#include "grid.h"
+#include "filters.h"
+#include "reshaping.h"
+#include "grid-allocator.h"
+
+// Planes past --max-memory live in temporary files, which must not change any result. The filters
+// run with no limit, with a limit that sends only some planes to files and with one that sends all
+
+struct Planes {
+	Grid<int> red, green, blue;
+
+	bool operator== (Planes const &other) const {
+		auto same = [](Grid<int> const &a, Grid<int> const &b) {
+			return a.height() == b.height() && a.width() == b.width() && std::equal(a.raw(), a.raw() + a.size(), b.raw());
+		};
+		return same(red, other.red) && same(green, other.green) && same(blue, other.blue);
+	}
+};
+
+Planes make_planes(size_t const height, size_t const width) {
+	std::mt19937 random(11);
+	std::uniform_int_distribution<int> noise(-20, 20);
+	Planes planes = {Grid<int>(height, width), Grid<int>(height, width), Grid<int>(height, width)};
+	Grid<int> * const channels[3] = {&planes.red, &planes.green, &planes.blue};
+
+	for (size_t c = 0; c < 3; c++) {
+		for (size_t y = 0; y < height; y++) {
+			for (size_t x = 0; x < width; x++) {
+				int const base = ((y / 29 + x / 41 + c) % 2) ? 210 : 30;
+				(*channels[c])[y][x] = std::clamp(base + noise(random), 0, 255);
+			}
+		}
+	}
+
+	return planes;
+}
+
+// Every filter the executable can run before quantization, one after the other
+Planes filter_all(size_t const limit) {
+	set_grid_memory_limit(limit);
+
+	Planes planes = make_planes(301, 419);
+	std::vector<Grid<int> *> const channels = {&planes.red, &planes.green, &planes.blue};
+
+	median_filter(channels, 2);
+
+	Grid<float> edges = 1 - detect_edges_sobel(rgb_to_greyscale(planes.red, planes.green, planes.blue));
+	blur_channels(channels, 10, 10 / 1.5f, &edges, 3);
+	blur_channels(channels, 40, 40 / 1.5f);
+
+	bilateral_filter(channels, rgb_to_greyscale(planes.red, planes.green, planes.blue), 6, 32);
+	guided_filter(channels, rgb_to_greyscale(planes.red, planes.green, planes.blue), 5, 0.01f);
+	antialias(&planes.red, &planes.green, &planes.blue, 8);
+
+	set_grid_memory_limit(0);
+	return planes;
+}
+
+int main() {
+	Planes const expected = filter_all(0);
+
+	// a plane of the test is about half a megabyte, so a few of them fit under the first limit
+	for (size_t const limit : {size_t{2} << 20, size_t{1}}) {
+		check(filter_all(limit) == expected, "filters with a limit of " + std::to_string(limit) + " bytes");
+	}
+
+	return failures;
+}
@@ -0,0 +1,95 @@
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "check.h"
+#include "grid.h"
+#include "reshaping.h"
+
+// The interleaving and deinterleaving are vectorized with a scalar tail, so they are checked against
+// plain loops at widths around every vector length and with values out of the byte range
+
+std::string describe(size_t const height, size_t const width, size_t const channels) {
+	return std::to_string(height) + "x" + std::to_string(width) + "x" + std::to_string(channels);
+}
+
+void check_deinterleave(std::mt19937 &random, size_t const height, size_t const width, size_t const channels) {
+	std::uniform_int_distribution<int> byte(0, 255);
+	std::vector<unsigned char> data(height * width * channels);
+	for (auto &value : data) value = static_cast<unsigned char>(byte(random));
+
+	Grid<int> red, green, blue, alpha;
+	bool const done = vectorize_to_rgb(data.data(), height, width, &red, &green, &blue, channels == 4 ? &alpha : nullptr);
+	check(done, "vectorize_to_rgb " + describe(height, width, channels));
+	if (!done) return;
+
+	Grid<int> const * const planes[4] = {&red, &green, &blue, &alpha};
+	bool same = true;
+
+	for (size_t y = 0; y < height; y++) {
+		for (size_t x = 0; x < width; x++) {
+			for (size_t c = 0; c < channels; c++) {
+				same &= (*planes[c])[y][x] == data[(y * width + x) * channels + c];
+			}
+		}
+	}
+
+	check(same, "deinterleaved planes " + describe(height, width, channels));
+}
+
+void check_interleave(std::mt19937 &random, size_t const height, size_t const width, size_t const channels) {
+	std::uniform_int_distribution<int> value(-300, 600);
+	Grid<int> planes[4];
+
+	for (size_t c = 0; c < channels; c++) {
+		planes[c] = Grid<int>(height, width);
+		for (size_t i = 0; i < planes[c].size(); i++) {
+			planes[c].raw()[i] = value(random);
+		}
+	}
+
+	Grid<int> const * const alpha = channels == 4 ? &planes[3] : nullptr;
+	std::vector<unsigned char> bytes(height * width * channels);
+	std::vector<float> floats(height * width * channels);
+
+	bool const done = flatten_into(bytes.data(), &planes[0], &planes[1], &planes[2], alpha)
+		&& flatten_into(floats.data(), &planes[0], &planes[1], &planes[2], alpha);
+	check(done, "flatten_into " + describe(height, width, channels));
+	if (!done) return;
+
+	bool same_bytes = true;
+	bool same_floats = true;
+
+	for (size_t y = 0; y < height; y++) {
+		for (size_t x = 0; x < width; x++) {
+			for (size_t c = 0; c < channels; c++) {
+				size_t const i = (y * width + x) * channels + c;
+				int const expected = std::clamp(planes[c][y][x], 0, 255);
+				same_bytes &= bytes[i] == expected;
+				same_floats &= floats[i] == static_cast<float>(expected) / 255;
+			}
+		}
+	}
+
+	check(same_bytes, "interleaved bytes " + describe(height, width, channels));
+	check(same_floats, "interleaved floats " + describe(height, width, channels));
+}
+
+int main() {
+	std::mt19937 random(7);
+
+	for (size_t const channels : {3, 4}) {
+		for (size_t const height : {1, 2, 17}) {
+			for (size_t width = 1; width <= 70; width++) {
+				check_deinterleave(random, height, width, channels);
+				check_interleave(random, height, width, channels);
+			}
+		}
+
+		check_deinterleave(random, 33, 1921, channels);
+		check_interleave(random, 33, 1921, channels);
+	}
+
+	return failures;
+}
@@ -0,0 +1,6 @@
+// The executable defines stb in main.cpp, the tests that link the sources need their own copy
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
@@ -0,0 +1,191 @@
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <utility>
+#include <cstdlib>
+#include <algorithm>
+#include <filesystem>
+
+#include "check.h"
+#include "netpbm.h"
+#include "row-reader.h"
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+// --stream has to give the same pixels as processing the whole image, so both are run by the
+// executable on odd sized images that span several bands and their outputs are compared.
+// Usage: test-stream <KQuantizer> <scratch directory>
+
+std::filesystem::path executable, scratch;
+
+// Blocks, a gradient and noise, so the median, the edges and every mode have something to work on
+std::vector<unsigned char> make_image(size_t const height, size_t const width, size_t const channels) {
+	std::mt19937 random(static_cast<unsigned>(height * width));
+	std::uniform_int_distribution<int> noise(-24, 24);
+	std::vector<unsigned char> data(height * width * channels);
+
+	for (size_t y = 0; y < height; y++) {
+		for (size_t x = 0; x < width; x++) {
+			bool const block = ((y / 37) + (x / 53)) % 2 == 0;
+			for (size_t c = 0; c < channels; c++) {
+				int const base = c == 3
+					? static_cast<int>(255 * y / height)
+					: (block ? 200 : 40) + static_cast<int>(40 * std::sin((x + 7 * c) * 0.05));
+				data[(y * width + x) * channels + c] = static_cast<unsigned char>(std::clamp(base + noise(random), 0, 255));
+			}
+		}
+	}
+
+	return data;
+}
+
+bool run(std::string const &arguments) {
+	std::string const command = "\"" + executable.string() + "\" " + arguments + " > /dev/null";
+	return std::system(command.c_str()) == 0;
+}
+
+// Whole is read by stb_image and streamed by the executable's own reader, both hold the same pixels
+void compare(
+	std::filesystem::path const &image,
+	std::filesystem::path const &input,
+	size_t const channels,
+	std::string const &mode,
+	std::string const &options
+) {
+	std::string const what = input.filename().string() + " " + mode + " " + options;
+	std::filesystem::path const whole = scratch / "whole.png";
+	std::filesystem::path const streamed = scratch / (channels == 4 ? "streamed.pam" : "streamed.ppm");
+
+	std::filesystem::remove(whole);
+	std::filesystem::remove(streamed);
+
+	bool const ran = run("\"" + image.string() + "\" " + mode + " -o \"" + whole.string() + "\" " + options)
+		&& run("\"" + input.string() + "\" " + mode + " --stream -o \"" + streamed.string() + "\" " + options);
+	check(ran, "running " + what);
+	if (!ran) return;
+
+	int width, height, whole_channels;
+	unsigned char * const expected = stbi_load(whole.c_str(), &width, &height, &whole_channels, 0);
+	check(expected != nullptr, "reading the whole image output of " + what);
+	if (!expected) return;
+
+	RowReader reader;
+	bool same = reader.open(streamed)
+		&& reader.height() == static_cast<size_t>(height)
+		&& reader.width() == static_cast<size_t>(width)
+		&& reader.channels() == static_cast<size_t>(whole_channels);
+
+	if (same) {
+		std::vector<unsigned char> pixels(reader.height() * reader.width() * reader.channels());
+		same = reader.read_rows(pixels.data(), reader.height())
+			&& std::equal(pixels.begin(), pixels.end(), expected);
+	}
+
+	stbi_image_free(expected);
+	check(same, "streamed output matches the whole image for " + what);
+}
+
+void check_image(std::string const &name, size_t const height, size_t const width, size_t const channels) {
+	std::vector<unsigned char> const data = make_image(height, width, channels);
+	std::filesystem::path const png = scratch / (name + ".png");
+	std::filesystem::path const netpbm = scratch / (name + (channels == 4 ? ".pam" : ".ppm"));
+	std::filesystem::path const bmp = scratch / (name + ".bmp");
+	std::filesystem::path const tga = scratch / (name + ".tga");
+
+	// both are written bottom up, 24 bit BMP rows are padded and RGBA ones use BI_BITFIELDS
+	stbi_write_tga_with_rle = 0;
+
+	NetpbmWriter writer;
+	bool const written = stbi_write_png(png.c_str(), width, height, channels, data.data(), 0)
+		&& stbi_write_bmp(bmp.c_str(), width, height, channels, data.data())
+		&& stbi_write_tga(tga.c_str(), width, height, channels, data.data())
+		&& writer.open(netpbm, height, width, channels)
+		&& writer.write_rows(data.data(), height)
+		&& writer.close();
+	check(written, "writing " + name);
+	if (!written) return;
+
+	for (std::string const mode : {"search", "equidistant", "self", "self-sort", "bw"}) {
+		for (std::string const options : {"", "-m 2", "-b 10", "-m 1 -b 40 --fast-edges"}) {
+			compare(png, netpbm, channels, mode, options);
+		}
+	}
+
+	// the readers only change how rows are read, one run without and one with filters covers them
+	for (std::filesystem::path const &input : {bmp, tga}) {
+		compare(png, input, channels, "search", "");
+		compare(png, input, channels, "self-sort", "-m 1 -b 40");
+	}
+}
+
+void put_little_endian(std::vector<unsigned char> &bytes, uint32_t const value, size_t const size) {
+	for (size_t i = 0; i < size; i++) {
+		bytes.push_back(static_cast<unsigned char>(value >> (8 * i)));
+	}
+}
+
+// Layouts stb_image_write does not make: a TGA stored top down, and a top down BI_RGB BMP of
+// 32 bit pixels whose fourth bytes are all 0, which stb_image reads as opaque
+void check_layouts(size_t const height, size_t const width) {
+	std::vector<unsigned char> const data = make_image(height, width, 3);
+	std::filesystem::path const tga = scratch / "top-down.tga";
+	std::filesystem::path const bmp = scratch / "top-down.bmp";
+
+	std::vector<unsigned char> tga_bytes = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	put_little_endian(tga_bytes, width, 2);
+	put_little_endian(tga_bytes, height, 2);
+	tga_bytes.push_back(24);
+	tga_bytes.push_back(0x20);
+
+	std::vector<unsigned char> bmp_bytes = {'B', 'M'};
+	put_little_endian(bmp_bytes, 14 + 40 + height * width * 4, 4);
+	put_little_endian(bmp_bytes, 0, 4);
+	put_little_endian(bmp_bytes, 14 + 40, 4);
+	put_little_endian(bmp_bytes, 40, 4);
+	put_little_endian(bmp_bytes, width, 4);
+	put_little_endian(bmp_bytes, static_cast<uint32_t>(-static_cast<int32_t>(height)), 4);
+	put_little_endian(bmp_bytes, 1, 2);
+	put_little_endian(bmp_bytes, 32, 2);
+	for (size_t i = 0; i < 6; i++) {
+		put_little_endian(bmp_bytes, 0, 4);
+	}
+
+	for (size_t i = 0; i < height * width; i++) {
+		unsigned char const * pixel = data.data() + i * 3;
+		tga_bytes.insert(tga_bytes.end(), {pixel[2], pixel[1], pixel[0]});
+		bmp_bytes.insert(bmp_bytes.end(), {pixel[2], pixel[1], pixel[0], 0});
+	}
+
+	bool written = true;
+	for (auto const &[path, bytes] : {std::pair{tga, &tga_bytes}, std::pair{bmp, &bmp_bytes}}) {
+		std::ofstream file(path, std::ios::binary);
+		file.write(reinterpret_cast<char const *>(bytes->data()), bytes->size());
+		written = written && file.good();
+	}
+	check(written, "writing the top down images");
+	if (!written) return;
+
+	compare(tga, tga, 3, "search", "-m 1 -b 40");
+	compare(bmp, bmp, 4, "search", "-m 1 -b 40");
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 3) {
+		std::cerr << "Usage: " << argv[0] << " <KQuantizer> <scratch directory>" << std::endl;
+		return 1;
+	}
+
+	executable = argv[1];
+	scratch = argv[2];
+	std::filesystem::create_directories(scratch);
+
+	// taller than one 256 row band, and not a multiple of the pyramid alignment
+	check_image("rgb", 517, 301, 3);
+	check_image("rgba", 389, 203, 4);
+	check_layouts(301, 211);
+
+	return failures;
+}